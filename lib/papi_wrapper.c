@@ -26,8 +26,11 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
 #include <math.h>
 #include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,50 +43,259 @@
 #    include <omp.h>
 #    include <pthread.h>
 #endif
+#if defined(PW_TRACE) && !defined(_OPENMP)
+#    include <pthread.h>
+#endif
+#if defined(PW_SAMPLING)
+#    include <dlfcn.h>
+#    include <elf.h>
+#    include <fcntl.h>
+#    include <link.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#endif
 
 /* Include definitions */
 #include "papi_wrapper.h"
 
+/* Events counted directly with perf_event: either all of them
+ * (-DPW_BACKEND_PERF), or the groups whose counters can be read in userspace
+ * with rdpmc (-DPW_RDPMC), which is not available when sampling */
+#if defined(PW_BACKEND_PERF) && defined(PW_SAMPLING)
+#    error "-DPW_SAMPLING is not supported by -DPW_BACKEND_PERF"
+#endif
+/* In PW_MPX_EXC mode all events are counted at once: each one on its own
+ * with perf_event, so the kernel multiplexes them and reports the time each
+ * one was counted, or else in an EventSet multiplexed by PAPI */
+#if (PW_EXEC_MODE == PW_MPX_EXC)
+#    if defined(PW_SAMPLING)
+#        error "-DPW_SAMPLING is not supported by PW_MPX_EXC"
+#    endif
+#    define PW_PERF_MPX
+#endif
+#if defined(PW_BACKEND_PERF) || defined(PW_PERF_MPX) \
+    || (defined(PW_RDPMC) && defined(__x86_64__) && !defined(PW_SAMPLING))
+#    define PW_USE_PERF
+#    include <errno.h>
+#    include <linux/perf_event.h>
+#    include <sys/ioctl.h>
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#endif
+#if defined(PW_USE_PERF) && defined(PW_RDPMC) && defined(__x86_64__) \
+    && !defined(PW_PERF_MPX)
+#    define PW_USE_RDPMC
+#endif
+
 /* By default, collect PAPI counters on thread 0. */
 #if !defined(PW_THREAD_MONITOR)
 #    define PW_THREAD_MONITOR 0
 #endif
 int pw_counters_threadid = PW_THREAD_MONITOR;
+int pw_cache_mode        = PW_CACHE_MODE;
 
 /* Macros defined for setting cache size */
 #if !defined(PW_CACHE_MB)
 #    define PW_CACHE_MB (1024 * 1024)
 #endif
 
-/* In bytes */
-#if !defined(PW_CACHE_SIZE)
-#    define PW_CACHE_SIZE (33 * PW_CACHE_MB)
-#endif
+/* In bytes, only if the last level cache can not be read from sysfs. With
+ * -DPW_CACHE_SIZE=<bytes>, each thread flushes that size instead */
+#define PW_CACHE_DEFAULT (33 * PW_CACHE_MB)
+
+/* Storage taken from the block of a thread is aligned to 8 bytes */
+#define PW_ARENA_ALIGN(__pw_bytes) (((__pw_bytes) + 7) & ~((size_t)7))
+
+/* Longest path of nested subregions printed */
+#define PW_PATH_MAX 1024
 
 /* Read configuration files */
-char *_pw_eventlist[] = {
+char *_pw_default_eventlist[] = {
 #include PAPI_FILE_LIST
     NULL};
 #if defined(PW_SAMPLING)
-int overflow_enabled   = 0;
-int _pw_samplinglist[] = {
+int overflow_enabled           = 0;
+int _pw_default_samplinglist[] = {
 #    include PAPI_FILE_SAMPLING
     -1};
 #endif
 
+/* Events (and thresholds) measured: the ones compiled in, unless given at
+ * runtime with the environment variables PW_EVENTS or PW_EVENTS_FILE
+ * (PW_THRESHOLDS or PW_THRESHOLDS_FILE), read by pw_load_lists */
+char **_pw_eventlist = _pw_default_eventlist;
+char * pw_events_buf = NULL;
+#if defined(PW_SAMPLING)
+int * _pw_samplinglist  = _pw_default_samplinglist;
+char *pw_thresholds_buf = NULL;
+#endif
+
+#if defined(PW_REPETITIONS)
+/* Variants of the region of interest measured together (pw_start_variants):
+ * number of variants while they are measured, and once done, order of the
+ * variant of each execution, and values of the events of each variant, round
+ * (once the warm-up ones are over), thread and event */
+int                pw_num_variants      = 0;
+int                pw_variants_measured = 0;
+int *              pw_variant_order     = NULL;
+long long *        pw_variant_values    = NULL;
+unsigned long long pw_variants_seed     = 0;
+#endif
+
+#if defined(PW_CALIBRATE)
+/* Empty executions of the region of interest and subregions measured by
+ * pw_calibrate (-DPW_CALIBRATE_RUNS=<n>) to take the median of. Meanwhile,
+ * pw_calibrating is set and executions are not traced nor recorded. Empty
+ * subregions are calls of pw_calibrate_subreg, which is not printed */
+#    if !defined(PW_CALIBRATE_RUNS)
+#        define PW_CALIBRATE_RUNS 101
+#    endif
+int pw_calibrating      = 0;
+int pw_calibrate_subreg = -1;
+#endif
+
+#if defined(PW_EVENTS_CACHE)
+/* Events cache of the current key: on a hit, pw_cache_fp is left after the
+ * codes, and the cache is rewritten when any of its contents changes */
+char *pw_cache_key   = NULL;
+char  pw_cache_file[PATH_MAX];
+FILE *pw_cache_fp    = NULL;
+int * pw_cache_codes = NULL;
+int   pw_cache_stale = 1;
+#endif
+
 /* Global variables */
 int *             pw_eventlist;
 int               pw_num_ctrs     = -1;
 int               pw_num_hw_ctrs  = -1;
 int               pw_multiplexing = 0;
-int               pw_eventset;
-long long         pw_values[PW_MAX_COUNTERS];
+int               pw_num_groups   = -1;
+int *             pw_group_events;
+int *             pw_group_offset;
 PW_thread_info_t *PW_thread;
 int               __PW_NSUBREGIONS = -1;
+int               pw_num_threads   = 0;
+size_t            pw_block_size    = 0;
+char **           pw_flush_buf     = NULL;
+size_t            pw_flush_size    = 0;
+int               pw_flush_nbufs   = 0;
+int               pw_flush_opt     = 0;
+
+/* Names of the subregions registered with pw_subregion_register. Their ids
+ * follow the ones set with pw_init_start_instruments_sub, and are found by
+ * name in an open addressing table of ids + 1 (0 if empty) */
+char **pw_named_names = NULL;
+int    pw_num_named   = 0;
+int    pw_named_cap   = 0;
+int *  pw_named_table = NULL;
+int    pw_named_slots = 0;
+
+/* Named subregions are allocated by each thread in chunks of this number */
+#if !defined(PW_NAMED_CHUNK)
+#    define PW_NAMED_CHUNK 16
+#endif
+
+/* Ranges of memory registered with pw_flush_range */
+typedef struct PW_range
+{
+    char * pw_ptr;
+    size_t pw_bytes;
+} PW_range_t;
+PW_range_t *pw_ranges  = NULL;
+int         pw_nranges = 0;
+
+#if defined(PW_TRACE)
+/* Trace of the calls of subregions: records are drained from the ring buffers
+ * of the threads to the file by a background thread */
+FILE *    pw_trace_fp    = NULL;
+size_t    pw_trace_size  = 0;
+int       pw_trace_nvals = 0;
+int       pw_trace_stop  = 0;
+pthread_t pw_trace_drainer;
+
+/* Microseconds between checks of the drainer */
+#    if !defined(PW_TRACE_POLL_US)
+#        define PW_TRACE_POLL_US 1000
+#    endif
+#endif
+
+#if defined(PW_SAMPLING)
+/* With -DPW_SAMPLING_RATE=<overflows per second>, thresholds are adapted
+ * after each execution of the region of interest: by a factor of
+ * PW_SAMPLING_STEP at most, and never below PW_SAMPLING_MIN_THRESHOLD */
+#    if !defined(PW_SAMPLING_STEP)
+#        define PW_SAMPLING_STEP 4
+#    endif
+#    if !defined(PW_SAMPLING_MIN_THRESHOLD)
+#        define PW_SAMPLING_MIN_THRESHOLD 1000
+#    endif
+
+/* Entries of each table of hotspots written */
+#    if !defined(PW_HOTSPOTS_TOP)
+#        define PW_HOTSPOTS_TOP 20
+#    endif
+
+/* Function or address where overflows occurred, and the events they stand
+ * for (the thresholds when they occurred) */
+typedef struct PW_hotspot
+{
+    void *      pw_addr;
+    void *      pw_func;
+    void *      pw_base;
+    const char *pw_name;
+    const char *pw_module;
+    long long   pw_count;
+    long long   pw_events;
+} PW_hotspot_t;
+
+/* Modules whose symbol tables are mapped while writing the hotspots */
+typedef struct PW_elf
+{
+    char * pw_path;
+    void * pw_map;
+    size_t pw_size;
+} PW_elf_t;
+PW_elf_t *pw_elfs  = NULL;
+int       pw_nelfs = 0;
+#endif
 
 /* Auxiliary functions */
 static void
 PW_error(const char *file, int line, const char *call, int __pw_retval);
+char *
+concat(const char *s1, const char *s2);
+#if defined(PW_TRACE)
+static void
+pw_trace_alloc(int __pw_nthread);
+static inline void
+pw_trace_append(int                __pw_nthread,
+                int                __pw_grp,
+                int                __pw_subreg_n,
+                unsigned long long begin,
+                unsigned long long end,
+                long long *        values,
+                long long *        delta);
+#endif
+#if defined(PW_REPETITIONS)
+static void
+pw_record_run(int __pw_nthread, int __pw_grp);
+#endif
+#if defined(PW_CALIBRATE)
+static void
+pw_calibrate();
+#endif
+
+/**
+ * @brief Current time, in ns
+ */
+static inline unsigned long long
+pw_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 #if defined(PW_DEBUG)
 #    include <stdarg.h>
 void
@@ -102,6 +314,20 @@ static inline void
 pw_dprintf(int dlvl, const char *fmt, ...){};
 #endif
 
+/**
+ * @brief Index in PW_thread of the caller: each thread has its own entry when
+ * PW_MULTITHREAD, otherwise only the monitor thread measures using entry 0
+ */
+static inline int
+pw_thread_id()
+{
+#if defined(PW_MULTITHREAD)
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
 /**
  * Cache line flush Intel Processors
  *
@@ -110,7 +336,7 @@ pw_dprintf(int dlvl, const char *fmt, ...){};
  * @note this flush is broadcast and extracted
  */
 void
-pw_intel_clflush(volatile void *p, unsigned int allocation_size)
+pw_intel_clflush(volatile void *p, size_t allocation_size)
 {
     const size_t cache_line = 64;
     const char * cp         = (const char *)p;
@@ -129,815 +355,4430 @@ pw_intel_clflush(volatile void *p, unsigned int allocation_size)
     asm volatile("sfence\n\t" : : : "memory");
 }
 
+#if PW_FLUSH == PW_FLUSH_CLFLUSHOPT
+#    include <cpuid.h>
 /**
- * @brief Dumb function to count number of counters to measure
+ * Cache line flush with clflushopt, which is weakly ordered so flushes of
+ * different lines are not serialized
+ *
+ * @param p pointer with address to flush
+ * @param allocation_size the size from p to flush
  */
 void
-pw_get_num_ctrs()
+pw_intel_clflushopt(volatile void *p, size_t allocation_size)
 {
-    int __pw_evid = 0;
-    for (__pw_evid = 0; _pw_eventlist[__pw_evid]; ++__pw_evid)
-    {
-    };
-    pw_num_ctrs = __pw_evid;
-#if defined(PAPI_VERSION) && (PAPI_VERSION_MAJOR(PAPI_VERSION) < 6)
-    pw_num_hw_ctrs = PAPI_num_counters();
-#else
-    pw_num_hw_ctrs = PAPI_get_cmp_opt(PAPI_MAX_HWCTRS, NULL, 0);
-#endif
-    if (pw_num_hw_ctrs < 0)
+    const size_t cache_line = 64;
+    const char * cp         = (const char *)p;
+    size_t       i          = 0;
+
+    if (p == NULL || allocation_size <= 0) return;
+
+    for (i = 0; i < allocation_size; i += cache_line)
     {
-        PW_error(__FILE__, __LINE__, "PAPI_num_counters", pw_num_hw_ctrs);
+        /* clflushopt encoding, for assemblers not supporting it */
+        asm volatile(".byte 0x66; clflush (%0)\n\t"
+                     :
+                     : "r"(&cp[i])
+                     : "memory");
     }
-#if (PW_EXEC_MODE == PW_ALL_EXC)
-    pw_multiplexing = (pw_num_ctrs > pw_num_hw_ctrs);
+    asm volatile("sfence\n\t" : : : "memory");
+}
 #endif
-    int max_multiplex = PAPI_get_opt(PAPI_MAX_MPX_CTRS, NULL);
-    pw_dprintf(PW_D_LOW, "max_multiplex = %d", max_multiplex);
-    pw_dprintf(PW_D_LOW,
-               "pw_num_ctrs = %d "
-               "pw_num_hw_ctrs = %d "
-               "pw_multiplexing = %d ",
-               pw_num_ctrs,
-               pw_num_hw_ctrs,
-               pw_multiplexing);
+
+#if !defined(PW_CACHE_SIZE)
+/**
+ * @brief Read a file of sysfs describing a cache of cpu0
+ *
+ * @param idx Index of the cache
+ * @param name Name of the file
+ * @param buf Content of the file
+ * @param len Size of buf
+ * @return PW_SUCCESS if read, PW_ERR otherwise
+ */
+static int
+pw_read_cache_info(int idx, const char *name, char *buf, int len)
+{
+    char  path[128];
+    FILE *fp;
+
+    snprintf(path,
+             sizeof(path),
+             "/sys/devices/system/cpu/cpu0/cache/index%d/%s",
+             idx,
+             name);
+    if ((fp = fopen(path, "r")) == NULL) return PW_ERR;
+    if (fgets(buf, len, fp) == NULL) buf[0] = '\0';
+    fclose(fp);
+    return PW_SUCCESS;
 }
 
 /**
- * @brief Flushes cache by using assembly instructions and calloc
+ * @brief Get the size of the last level cache and the number of CPUs sharing
+ * it, from sysfs
  *
+ * @param size Size in bytes
+ * @param ncpus Number of CPUs sharing it
+ * @return PW_SUCCESS if found, PW_ERR otherwise
  */
-void
-pw_prepare_instruments()
+static int
+pw_get_llc(size_t *size, int *ncpus)
 {
-#if defined(_OPENMP)
-#    pragma omp parallel
+    char buf[1024];
+    int  best = 0;
+    int  idx;
+
+    for (idx = 0;
+         pw_read_cache_info(idx, "type", buf, sizeof(buf)) == PW_SUCCESS;
+         ++idx)
     {
-#endif
-        int cache_elemns = PW_CACHE_SIZE / sizeof(double);
-        /* calloc() sets memory to zero */
-        double *flush = (double *)calloc(cache_elemns, sizeof(double));
-#if defined(__x86_64)
-        pw_intel_clflush(flush, cache_elemns * sizeof(double));
-#endif
-        free(flush);
-#if defined(_OPENMP)
-#    pragma omp barrier
+        char *tok;
+        char  unit  = 'B';
+        int   level = 0;
+        int   lo, hi;
+
+        if (strncmp(buf, "Instruction", 11) == 0) continue;
+        if ((pw_read_cache_info(idx, "level", buf, sizeof(buf)) != PW_SUCCESS)
+            || (sscanf(buf, "%d", &level) != 1) || (level <= best))
+            continue;
+        if ((pw_read_cache_info(idx, "size", buf, sizeof(buf)) != PW_SUCCESS)
+            || (sscanf(buf, "%zu%c", size, &unit) < 1))
+            continue;
+        if (unit == 'K') *size *= 1024;
+        if (unit == 'M') *size *= PW_CACHE_MB;
+        best   = level;
+        *ncpus = 0;
+        if (pw_read_cache_info(idx, "shared_cpu_list", buf, sizeof(buf))
+            != PW_SUCCESS)
+            continue;
+        /* e.g. 0-15,32-47 */
+        for (tok = strtok(buf, ",\n"); tok != NULL; tok = strtok(NULL, ",\n"))
+        {
+            if (sscanf(tok, "%d-%d", &lo, &hi) == 2)
+                *ncpus += hi - lo + 1;
+            else
+                *ncpus += 1;
+        }
     }
-#endif
+    if (*ncpus < 1) *ncpus = 1;
+    return (best > 0) ? PW_SUCCESS : PW_ERR;
 }
+#endif
 
 /**
- * @brief Display PAPI errors
+ * @brief Size the flush buffers of the threads. Threads sharing the last level
+ * cache evict it together, so each one sweeps 1.5x its share of it
  *
- * @param file File name
- * @param line Line where the error occurred
- * @param call Function called
- * @param __pw_retval Value returned
- * @note based on test_fail in papi_utils.c
+ * @param __pw_nthreads Number of threads flushing
  */
 static void
-PW_error(const char *file, int line, const char *call, int __pw_retval)
+pw_flush_init(int __pw_nthreads)
 {
-    char buf[128];
+#if defined(PW_CACHE_SIZE)
+    pw_flush_size = PW_CACHE_SIZE;
+#else
+    size_t llc   = PW_CACHE_DEFAULT;
+    int    ncpus = 1;
 
-    memset(buf, '\0', sizeof(buf));
-    if (__pw_retval != 0)
-        fprintf(stdout, "%-40s FAILED\nLine # %d\n", file, line);
-    else
+    if (pw_get_llc(&llc, &ncpus) != PW_SUCCESS)
     {
-        fprintf(stdout, "%-40s SKIPPED\n", file);
-        fprintf(stdout, "Line # %d\n", line);
+        pw_dprintf(PW_D_WARNING, "[WARNING] LLC size not found in sysfs!");
     }
-
-    switch (__pw_retval)
-    {
-        case PAPI_ESYS:
-            sprintf(buf, "System error in %s", call);
-            perror(buf);
-            break;
-        default:
-            // PAPI 5.4.3 has changed the API for PAPI_perror.
-#if defined(PAPI_VERSION)                          \
-    && ((PAPI_VERSION_MAJOR(PAPI_VERSION) == 5     \
-         && PAPI_VERSION_MINOR(PAPI_VERSION) >= 4) \
-        || PAPI_VERSION_MAJOR(PAPI_VERSION) > 5)
-            fprintf(
-                stdout, "Error in %s: %s\n", call, PAPI_strerror(__pw_retval));
-#else
-            PAPI_perror(__pw_retval, errstring, PAPI_MAX_STR_LEN);
-            fprintf(stdout, "Error in %s: %s\n", call, errstring);
+    if (ncpus > __pw_nthreads) ncpus = __pw_nthreads;
+    pw_flush_size = (llc + llc / 2) / ncpus;
+    pw_dprintf(
+        PW_D_LOW, "llc = %zu bytes; shared by %d threads", llc, ncpus);
 #endif
-    }
-    fprintf(stdout, "\n");
-    if (PAPI_is_initialized()) PAPI_shutdown();
-    exit(PW_ERR);
+    pw_flush_size  = (pw_flush_size + 63) & ~((size_t)63);
+    pw_flush_nbufs = __pw_nthreads;
+    pw_flush_buf   = (char **)calloc(__pw_nthreads, sizeof(char *));
+#if PW_FLUSH == PW_FLUSH_CLFLUSHOPT
+    unsigned int eax, ebx, ecx, edx;
+    pw_flush_opt = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)
+                   && (ebx & (1 << 23));
+    if (!pw_flush_opt)
+        pw_dprintf(PW_D_WARNING, "[WARNING] clflushopt not available!");
+#endif
+    pw_dprintf(PW_D_LOW,
+               "pw_flush_size = %zu bytes per thread; %d threads",
+               pw_flush_size,
+               __pw_nthreads);
 }
 
-#if defined(PW_SAMPLING)
 /**
- * @brief Handling event overflow
+ * @brief Allocate the flush buffer of the calling thread, touching it so it
+ * is placed in its NUMA node
  *
- * @param EventSet Event set which produces the overflow
- * @param address
- * @param overflow_vector
- * @param context
+ * @param __pw_nthread Thread number
  */
-void
-pw_overflow_handler(int       event_set,
-                    void *    address,
-                    long long overflow_vector,
-                    void *    context)
+static void
+pw_flush_alloc(int __pw_nthread)
 {
-    int __pw_retval;
-    int __pw_nthread = omp_get_thread_num();
-    PW_OVRFLW(__pw_nthread, event_set)++;
-    if ((__pw_retval = PAPI_reset(event_set)) != PAPI_OK)
+    char *buf;
+
+    if (__pw_nthread >= pw_flush_nbufs) return;
+    if ((buf = (char *)aligned_alloc(64, pw_flush_size)) == NULL)
+        PW_error(__FILE__, __LINE__, "aligned_alloc", PAPI_ESYS);
+    memset(buf, 0, pw_flush_size);
+    pw_flush_buf[__pw_nthread] = buf;
+}
+
+/**
+ * @brief Free the flush buffers of all threads and forget registered ranges
+ */
+static void
+pw_flush_free()
+{
+    int k;
+
+    for (k = 0; k < pw_flush_nbufs; ++k)
     {
-        PW_error(__FILE__, __LINE__, "PAPI_reset", __pw_retval);
+        free(pw_flush_buf[k]);
     }
+    free(pw_flush_buf);
+    pw_flush_buf   = NULL;
+    pw_flush_nbufs = 0;
+    free(pw_ranges);
+    pw_ranges  = NULL;
+    pw_nranges = 0;
 }
-#endif
 
 /**
- * @brief PAPI set options
+ * @brief Evict the caches: the buffer is written, so it replaces any other
+ * line, and then it is either flushed (PW_FLUSH_CLFLUSH, PW_FLUSH_CLFLUSHOPT)
+ * or read (PW_FLUSH_STREAM)
  *
- * @param __pw_nthread Thread number of caller
+ * @param buf Flush buffer of the thread
  */
-void
-pw_set_opts(int __pw_nthread, int __pw_evid)
+static void
+pw_flush_buffer(char *buf)
 {
-    int           __pw_retval;
-    PAPI_option_t options;
+    const size_t   cache_line = 64;
+    volatile char *vbuf       = buf;
+    size_t         i;
 
-#if defined(PW_MULTITHREAD)
-    int evtset = PW_EVTSET(__pw_nthread, __pw_evid);
+    for (i = 0; i < pw_flush_size; i += cache_line)
+    {
+        vbuf[i] = (char)i;
+    }
+#if PW_FLUSH == PW_FLUSH_STREAM
+    char sink = 0;
+    for (i = 0; i < pw_flush_size; i += cache_line)
+    {
+        sink += vbuf[i];
+    }
+    (void)sink;
+#elif PW_FLUSH == PW_FLUSH_CLFLUSHOPT
+    if (pw_flush_opt)
+        pw_intel_clflushopt(buf, pw_flush_size);
+    else
+        pw_intel_clflush(buf, pw_flush_size);
 #else
-    int evtset = pw_eventset;
+    pw_intel_clflush(buf, pw_flush_size);
 #endif
+}
 
-    /* Domain */
-    memset(&options, 0x0, sizeof(options));
-    options.domain.eventset = evtset;
-    options.domain.domain   = PW_DOM;
-    if ((__pw_retval = PAPI_set_opt(PAPI_DOMAIN, &options)) != PAPI_OK)
+#if defined(PW_USE_PERF)
+/* perf_event groups: one file descriptor per event, the first one being the
+ * leader, so a single read() returns all of them (PERF_FORMAT_GROUP). With
+ * PW_PERF_MPX every event is a group on its own instead */
+#    define PW_PERF_MAX_EVENTS 32
+
+typedef struct PW_perf_group
+{
+    int                          pw_nfds;
+    int                          pw_fd[PW_PERF_MAX_EVENTS];
+    int                          pw_evid[PW_PERF_MAX_EVENTS];
+    struct perf_event_mmap_page *pw_page[PW_PERF_MAX_EVENTS];
+#    if defined(PW_PERF_MPX)
+    double pw_coverage[PW_PERF_MAX_EVENTS];
+#    endif
+} PW_perf_group_t;
+
+#    define PW_PERF(__pw_nthread, __pw_grp) \
+        (((PW_perf_group_t *)PW_thread[__pw_nthread].pw_perf)[__pw_grp])
+#    define PW_PERF_CACHE(__pw_cache, __pw_op, __pw_result) \
+        (PERF_COUNT_HW_CACHE_##__pw_cache                   \
+         | (PERF_COUNT_HW_CACHE_OP_##__pw_op << 8)          \
+         | (PERF_COUNT_HW_CACHE_RESULT_##__pw_result << 16))
+
+/* perf_event generic events, by PAPI preset name and by perf-list name. The
+ * presets are only approximations (e.g. PAPI_L1_DCM counts loads only), so
+ * they are only taken here by -DPW_BACKEND_PERF: otherwise PAPI counts them */
+static const struct
+{
+    const char *       name;
+    unsigned int       type;
+    unsigned long long config;
+} pw_perf_events[] = {
+    {"PAPI_TOT_CYC", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"PAPI_REF_CYC", PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES},
+    {"PAPI_TOT_INS", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"PAPI_BR_INS", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"PAPI_BR_MSP", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"PAPI_L3_TCA", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {"PAPI_L3_TCM", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"PAPI_L1_DCM", PERF_TYPE_HW_CACHE, PW_PERF_CACHE(L1D, READ, MISS)},
+    {"PAPI_L1_ICM", PERF_TYPE_HW_CACHE, PW_PERF_CACHE(L1I, READ, MISS)},
+    {"PAPI_TLB_DM", PERF_TYPE_HW_CACHE, PW_PERF_CACHE(DTLB, READ, MISS)},
+    {"PAPI_TLB_IM", PERF_TYPE_HW_CACHE, PW_PERF_CACHE(ITLB, READ, MISS)},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"ref-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"L1-dcache-load-misses",
+     PERF_TYPE_HW_CACHE,
+     PW_PERF_CACHE(L1D, READ, MISS)},
+    {"L1-icache-load-misses",
+     PERF_TYPE_HW_CACHE,
+     PW_PERF_CACHE(L1I, READ, MISS)},
+    {"dTLB-load-misses", PERF_TYPE_HW_CACHE, PW_PERF_CACHE(DTLB, READ, MISS)},
+    {"iTLB-load-misses", PERF_TYPE_HW_CACHE, PW_PERF_CACHE(ITLB, READ, MISS)},
+    {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {"cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+    {NULL, 0, 0}};
+
+/**
+ * @brief Translate an event name into its perf_event attributes: generic
+ * events (see pw_perf_events) or raw events as in perf-list, i.e. r<hex>.
+ * PAPI presets are left to PAPI, unless using -DPW_BACKEND_PERF
+ *
+ * @param name Name of the event
+ * @param attr Attributes of the event
+ * @return PW_SUCCESS if the event is known, PW_ERR otherwise
+ */
+static int
+pw_perf_event(const char *name, struct perf_event_attr *attr)
+{
+    char *end;
+    int   k;
+
+    memset(attr, 0, sizeof(struct perf_event_attr));
+    attr->size = sizeof(struct perf_event_attr);
+#    if !defined(PW_BACKEND_PERF)
+    /* Same meaning whether multiplexed, read with rdpmc or not */
+    if (strncmp(name, "PAPI_", 5) == 0) return PW_ERR;
+#    endif
+    for (k = 0; pw_perf_events[k].name != NULL; ++k)
     {
-        pw_dprintf(PW_D_WARNING, "[WARNING] Domain could not be set!");
+        if (strcmp(pw_perf_events[k].name, name) == 0)
+        {
+            attr->type   = pw_perf_events[k].type;
+            attr->config = pw_perf_events[k].config;
+            return PW_SUCCESS;
+        }
     }
-
-    /* Granularity */
-    memset(&options, 0x0, sizeof(options));
-    options.granularity.eventset    = evtset;
-    options.granularity.granularity = PW_GRN;
-    if ((__pw_retval = PAPI_set_opt(PAPI_GRANUL, &options)) != PAPI_OK)
+    if ((name[0] == 'r') && (name[1] != '\0'))
     {
-        pw_dprintf(PW_D_WARNING, "[WARNING] Granularity could not be set!");
+        attr->type   = PERF_TYPE_RAW;
+        attr->config = strtoull(&name[1], &end, 16);
+        if (*end == '\0') return PW_SUCCESS;
     }
+    return PW_ERR;
 }
 
 /**
- * @brief Auxiliary function to concat strings
+ * @brief Add an event to a perf_event group of the calling thread. The first
+ * event becomes the leader, which is created disabled
+ *
+ * @param grp perf_event group
+ * @param __pw_evid Event id
+ * @return 0 if added, errno value otherwise (e.g. the event does not fit in
+ * the hardware counters along with the rest of the group)
  */
-char *
-concat(const char *s1, const char *s2)
+static int
+pw_perf_add(PW_perf_group_t *grp, int __pw_evid)
 {
-    char *result =
-        malloc(strlen(s1) + strlen(s2) + 1); // +1 for the null-terminator
-    // in real code you would check for errors in malloc here
-    strcpy(result, s1);
-    strcat(result, s2);
-    return result;
-}
+    struct perf_event_attr       attr;
+    struct perf_event_mmap_page *page = NULL;
+    int                          fd;
 
-/* Core functions */
+    int                          leader;
+
+    if (grp->pw_nfds == PW_PERF_MAX_EVENTS) return E2BIG;
+    if (pw_perf_event(_pw_eventlist[__pw_evid], &attr) != PW_SUCCESS)
+        return ENOENT;
+#    if defined(PW_PERF_MPX)
+    attr.disabled    = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                       | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    leader           = -1;
+#    else
+    attr.disabled    = (grp->pw_nfds == 0);
+    attr.read_format = PERF_FORMAT_GROUP;
+    leader           = (grp->pw_nfds == 0) ? -1 : grp->pw_fd[0];
+#    endif
+    attr.exclude_user   = !(PW_DOM & PAPI_DOM_USER);
+    attr.exclude_kernel = !(PW_DOM & PAPI_DOM_KERNEL);
+    attr.exclude_hv     = !(PW_DOM & PAPI_DOM_SUPERVISOR);
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+    if (fd < 0) return errno;
+#    if defined(PW_USE_RDPMC)
+    page = (struct perf_event_mmap_page *)mmap(
+        NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED)
+    {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+#        if !defined(PW_BACKEND_PERF)
+    /* Otherwise PAPI is used for the group */
+    if (!page->cap_user_rdpmc)
+    {
+        munmap(page, sysconf(_SC_PAGESIZE));
+        close(fd);
+        return EOPNOTSUPP;
+    }
+#        endif
+#    endif
+    grp->pw_fd[grp->pw_nfds]   = fd;
+    grp->pw_evid[grp->pw_nfds] = __pw_evid;
+    grp->pw_page[grp->pw_nfds] = page;
+    ++grp->pw_nfds;
+    return 0;
+}
 
+#    if defined(PW_BACKEND_PERF)
 /**
- * @brief PAPI initialization
+ * @brief Remove an event from a perf_event group
  *
- * @note This function must be called
+ * @note The leader cannot be removed: the rest of events would become
+ * singleton groups
  */
-void
-pw_init()
+static void
+pw_perf_remove(PW_perf_group_t *grp, int __pw_evid)
 {
-#if defined(PW_MULTITHREAD) && !defined(_OPENMP)
-    PW_error(__FILE__,
-             __LINE__,
-             "pw_init(): -DPW_MULTITHREAD missing -fopenmp compilation flag",
-             PAPI_EINVAL);
+    int __pw_pos;
+
+    for (__pw_pos = 1; __pw_pos < grp->pw_nfds; ++__pw_pos)
+    {
+        if (grp->pw_evid[__pw_pos] == __pw_evid) break;
+    }
+    if (__pw_pos == grp->pw_nfds) return;
+    if (grp->pw_page[__pw_pos] != NULL)
+        munmap(grp->pw_page[__pw_pos], sysconf(_SC_PAGESIZE));
+    close(grp->pw_fd[__pw_pos]);
+    for (--grp->pw_nfds; __pw_pos < grp->pw_nfds; ++__pw_pos)
+    {
+        grp->pw_fd[__pw_pos]   = grp->pw_fd[__pw_pos + 1];
+        grp->pw_evid[__pw_pos] = grp->pw_evid[__pw_pos + 1];
+        grp->pw_page[__pw_pos] = grp->pw_page[__pw_pos + 1];
+    }
+}
+#    endif
+
+/**
+ * @brief Close all file descriptors and mappings of a perf_event group
+ */
+static void
+pw_perf_close(PW_perf_group_t *grp)
+{
+    int __pw_pos;
+
+    for (__pw_pos = grp->pw_nfds - 1; __pw_pos >= 0; --__pw_pos)
+    {
+        if (grp->pw_page[__pw_pos] != NULL)
+            munmap(grp->pw_page[__pw_pos], sysconf(_SC_PAGESIZE));
+        close(grp->pw_fd[__pw_pos]);
+    }
+    grp->pw_nfds = 0;
+}
+
+/**
+ * @brief Open all events of a group as a perf_event group
+ *
+ * @param grp perf_event group
+ * @param __pw_grp Group id
+ * @return 0 if opened, errno value otherwise
+ */
+static int
+pw_perf_open(PW_perf_group_t *grp, int __pw_grp)
+{
+    int __pw_retval = 0;
+    int __pw_pos;
+
+    memset(grp, 0, sizeof(PW_perf_group_t));
+    for (__pw_pos = 0; __pw_pos < PW_GRP_SIZE(__pw_grp); ++__pw_pos)
+    {
+        if ((__pw_retval = pw_perf_add(grp, PW_GRP_EVT(__pw_grp, __pw_pos)))
+            != 0)
+        {
+            pw_dprintf(PW_D_LOW,
+                       "%2d __pw_grp; perf_event_open failed for %s",
+                       __pw_grp,
+                       _pw_eventlist[PW_GRP_EVT(__pw_grp, __pw_pos)]);
+            pw_perf_close(grp);
+            break;
+        }
+    }
+    return __pw_retval;
+}
+
+/**
+ * @brief Reset and enable all counters of a perf_event group
+ */
+static void
+pw_perf_start(PW_perf_group_t *grp)
+{
+#    if defined(PW_PERF_MPX)
+    int __pw_pos;
+
+    for (__pw_pos = 0; __pw_pos < grp->pw_nfds; ++__pw_pos)
+    {
+        if ((ioctl(grp->pw_fd[__pw_pos], PERF_EVENT_IOC_RESET, 0) == -1)
+            || (ioctl(grp->pw_fd[__pw_pos], PERF_EVENT_IOC_ENABLE, 0) == -1))
+            PW_error(__FILE__, __LINE__, "ioctl", PAPI_ESYS);
+    }
+#    else
+    if ((ioctl(grp->pw_fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) == -1)
+        || (ioctl(grp->pw_fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP)
+            == -1))
+        PW_error(__FILE__, __LINE__, "ioctl", PAPI_ESYS);
+#    endif
+}
+
+/**
+ * @brief Read all counters of a perf_event group with a single read(), or
+ * with a read() per event with PW_PERF_MPX
+ */
+static void
+pw_perf_read(PW_perf_group_t *grp, long long *values)
+{
+    unsigned long long buf[1 + PW_PERF_MAX_EVENTS];
+    int                __pw_pos;
+
+#    if defined(PW_PERF_MPX)
+    /* Value, time enabled and time running of each event: the value is
+     * scaled as if it had been counted all the time it was enabled */
+    for (__pw_pos = 0; __pw_pos < grp->pw_nfds; ++__pw_pos)
+    {
+        if (read(grp->pw_fd[__pw_pos], buf, 3 * sizeof(buf[0])) == -1)
+            PW_error(__FILE__, __LINE__, "read", PAPI_ESYS);
+        values[__pw_pos]           = 0;
+        grp->pw_coverage[__pw_pos] = 0.0;
+        if (buf[2] == 0) continue;
+        values[__pw_pos] = (long long)((double)buf[0] * buf[1] / buf[2]);
+        grp->pw_coverage[__pw_pos] = (double)buf[2] / buf[1];
+    }
+#    else
+    if (read(grp->pw_fd[0], buf, sizeof(buf)) == -1)
+        PW_error(__FILE__, __LINE__, "read", PAPI_ESYS);
+    for (__pw_pos = 0; __pw_pos < grp->pw_nfds; ++__pw_pos)
+    {
+        values[__pw_pos] = buf[1 + __pw_pos];
+    }
+#    endif
+}
+
+/**
+ * @brief Disable all counters of a perf_event group and read them
+ */
+static void
+pw_perf_stop(PW_perf_group_t *grp, long long *values)
+{
+#    if defined(PW_PERF_MPX)
+    int __pw_pos;
+
+    for (__pw_pos = 0; __pw_pos < grp->pw_nfds; ++__pw_pos)
+    {
+        if (ioctl(grp->pw_fd[__pw_pos], PERF_EVENT_IOC_DISABLE, 0) == -1)
+            PW_error(__FILE__, __LINE__, "ioctl", PAPI_ESYS);
+    }
+#    else
+    if (ioctl(grp->pw_fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP)
+        == -1)
+        PW_error(__FILE__, __LINE__, "ioctl", PAPI_ESYS);
+#    endif
+    pw_perf_read(grp, values);
+}
+
+#    if defined(PW_USE_RDPMC)
+static inline unsigned long long
+pw_rdpmc(unsigned int counter)
+{
+    unsigned int low, high;
+    asm volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+    return (unsigned long long)low | ((unsigned long long)high << 32);
+}
+
+/**
+ * @brief Read all counters of a perf_event group in userspace, following the
+ * seqlock protocol of perf_event_mmap_page. If any event can not be read with
+ * rdpmc at the moment (e.g. not scheduled), the group is read with read()
+ */
+static void
+pw_perf_rdpmc(PW_perf_group_t *grp, long long *values)
+{
+    int __pw_pos;
+
+    for (__pw_pos = 0; __pw_pos < grp->pw_nfds; ++__pw_pos)
+    {
+        volatile struct perf_event_mmap_page *pc = grp->pw_page[__pw_pos];
+        unsigned int                          seq;
+        unsigned int                          idx;
+        long long                             count;
+
+        do
+        {
+            seq = pc->lock;
+            asm volatile("" : : : "memory");
+            idx   = pc->cap_user_rdpmc ? pc->index : 0;
+            count = pc->offset;
+            if (idx)
+            {
+                unsigned short width = pc->pmc_width;
+                long long      pmc   = pw_rdpmc(idx - 1);
+                pmc <<= 64 - width;
+                pmc >>= 64 - width;
+                count += pmc;
+            }
+            asm volatile("" : : : "memory");
+        } while (pc->lock != seq);
+        if (!idx)
+        {
+            pw_perf_read(grp, values);
+            return;
+        }
+        values[__pw_pos] = count;
+    }
+}
+#    endif
+#endif
+
+/**
+ * @brief Dumb function to count number of counters to measure
+ */
+void
+pw_get_num_ctrs()
+{
+    int __pw_evid = 0;
+    for (__pw_evid = 0; _pw_eventlist[__pw_evid]; ++__pw_evid)
+    {
+    };
+    pw_num_ctrs = __pw_evid;
+#if !defined(PW_BACKEND_PERF)
+#    if defined(PAPI_VERSION) && (PAPI_VERSION_MAJOR(PAPI_VERSION) < 6)
+    pw_num_hw_ctrs = PAPI_num_counters();
+#    else
+    pw_num_hw_ctrs = PAPI_get_cmp_opt(PAPI_MAX_HWCTRS, NULL, 0);
+#    endif
+    if (pw_num_hw_ctrs < 0)
+    {
+        PW_error(__FILE__, __LINE__, "PAPI_num_counters", pw_num_hw_ctrs);
+    }
+    int max_multiplex = PAPI_get_opt(PAPI_MAX_MPX_CTRS, NULL);
+    pw_dprintf(PW_D_LOW, "max_multiplex = %d", max_multiplex);
+#endif
+    pw_dprintf(PW_D_LOW,
+               "pw_num_ctrs = %d "
+               "pw_num_hw_ctrs = %d "
+               "pw_multiplexing = %d ",
+               pw_num_ctrs,
+               pw_num_hw_ctrs,
+               pw_multiplexing);
+}
+
+/* Trial EventSets used for planning the groups of events */
+#if defined(PW_BACKEND_PERF)
+typedef PW_perf_group_t *PW_trial_t;
+#    define PW_TRIAL_NULL NULL
+
+static int
+pw_trial_create(PW_trial_t *trial)
+{
+    *trial = (PW_perf_group_t *)calloc(1, sizeof(PW_perf_group_t));
+    return PAPI_OK;
+}
+
+/* The kernel checks whether the whole group fits in the hardware counters */
+static int
+pw_trial_add(PW_trial_t trial, int __pw_evid)
+{
+    return (pw_perf_add(trial, __pw_evid) == 0) ? PAPI_OK : PAPI_EINVAL;
+}
+
+static void
+pw_trial_remove(PW_trial_t trial, int __pw_evid)
+{
+    pw_perf_remove(trial, __pw_evid);
+}
+
+static void
+pw_trial_destroy(PW_trial_t *trial)
+{
+    pw_perf_close(*trial);
+    free(*trial);
+    *trial = PW_TRIAL_NULL;
+}
+#else
+typedef int PW_trial_t;
+#    define PW_TRIAL_NULL PAPI_NULL
+
+static int
+pw_trial_create(PW_trial_t *trial)
+{
+    *trial = PAPI_NULL;
+    return PAPI_create_eventset(trial);
+}
+
+static int
+pw_trial_add(PW_trial_t trial, int __pw_evid)
+{
+    return PAPI_add_event(trial, pw_eventlist[__pw_evid]);
+}
+
+static void
+pw_trial_remove(PW_trial_t trial, int __pw_evid)
+{
+    PAPI_remove_event(trial, pw_eventlist[__pw_evid]);
+}
+
+static void
+pw_trial_destroy(PW_trial_t *trial)
+{
+    PAPI_cleanup_eventset(*trial);
+    PAPI_destroy_eventset(trial);
+    *trial = PW_TRIAL_NULL;
+}
+#endif
+
+/**
+ * @brief Check whether all the events of a group can be counted together in a
+ * single EventSet
+ *
+ * @param __pw_grp Group id
+ * @return PAPI_OK if feasible, PAPI error code otherwise
+ */
+int
+pw_check_group(int __pw_grp)
+{
+    int        __pw_retval;
+    int        __pw_pos;
+    PW_trial_t trial;
+
+    if ((__pw_retval = pw_trial_create(&trial)) != PAPI_OK) return __pw_retval;
+    for (__pw_pos = 0; __pw_pos < PW_GRP_SIZE(__pw_grp); ++__pw_pos)
+    {
+        if ((__pw_retval = pw_trial_add(trial, PW_GRP_EVT(__pw_grp, __pw_pos)))
+            != PAPI_OK)
+            break;
+    }
+    pw_trial_destroy(&trial);
+    return __pw_retval;
+}
+
+/**
+ * @brief Build the groups of events by trial and error: each event is added to
+ * the first group whose EventSet accepts it (fixed counters, constrained
+ * counters or offcore registers are handled by PAPI_add_event). Afterwards, it
+ * tries to dissolve each group moving its events into the other ones, so the
+ * number of executions of the region of interest is close to the minimum
+ */
+void
+pw_plan_groups()
+{
+    int         __pw_retval;
+    int         __pw_evid;
+    int         __pw_grp;
+    int         __pw_other;
+    int         __pw_ngroups = 0;
+    PW_trial_t *__pw_trial =
+        (PW_trial_t *)malloc(sizeof(PW_trial_t) * pw_num_ctrs);
+    int *__pw_group = (int *)malloc(sizeof(int) * pw_num_ctrs);
+    int *__pw_moved = (int *)malloc(sizeof(int) * pw_num_ctrs);
+
+    /* First fit */
+    for (__pw_evid = 0; __pw_evid < pw_num_ctrs; ++__pw_evid)
+    {
+        for (__pw_grp = 0; __pw_grp < __pw_ngroups; ++__pw_grp)
+        {
+            if (pw_trial_add(__pw_trial[__pw_grp], __pw_evid) == PAPI_OK)
+                break;
+        }
+        if (__pw_grp == __pw_ngroups)
+        {
+            if ((__pw_retval = pw_trial_create(&__pw_trial[__pw_grp]))
+                != PAPI_OK)
+                PW_error(__FILE__, __LINE__, "pw_trial_create", __pw_retval);
+            if ((__pw_retval = pw_trial_add(__pw_trial[__pw_grp], __pw_evid))
+                != PAPI_OK)
+                PW_error(__FILE__,
+                         __LINE__,
+                         concat("pw_trial_add: ", _pw_eventlist[__pw_evid]),
+                         __pw_retval);
+            ++__pw_ngroups;
+        }
+        __pw_group[__pw_evid] = __pw_grp;
+    }
+
+    /* Dissolve groups: later groups may accept events rejected earlier */
+    for (__pw_grp = __pw_ngroups - 1; __pw_grp >= 0; --__pw_grp)
+    {
+        int __pw_ok = 1;
+        for (__pw_evid = 0; __pw_evid < pw_num_ctrs && __pw_ok; ++__pw_evid)
+        {
+            __pw_moved[__pw_evid] = -1;
+            if (__pw_group[__pw_evid] != __pw_grp) continue;
+            __pw_ok = 0;
+            for (__pw_other = 0; __pw_other < __pw_ngroups; ++__pw_other)
+            {
+                if ((__pw_other == __pw_grp)
+                    || (__pw_trial[__pw_other] == PW_TRIAL_NULL))
+                    continue;
+                if (pw_trial_add(__pw_trial[__pw_other], __pw_evid) == PAPI_OK)
+                {
+                    __pw_moved[__pw_evid] = __pw_other;
+                    __pw_ok               = 1;
+                    break;
+                }
+            }
+        }
+        for (--__pw_evid; __pw_evid >= 0; --__pw_evid)
+        {
+            if (__pw_moved[__pw_evid] == -1) continue;
+            if (__pw_ok)
+            {
+                __pw_group[__pw_evid] = __pw_moved[__pw_evid];
+            } else
+            {
+                pw_trial_remove(__pw_trial[__pw_moved[__pw_evid]], __pw_evid);
+            }
+        }
+        if (__pw_ok) pw_trial_destroy(&__pw_trial[__pw_grp]);
+    }
+
+    /* Keep the surviving groups in order */
+    pw_num_groups      = 0;
+    pw_group_offset[0] = 0;
+    for (__pw_grp = 0; __pw_grp < __pw_ngroups; ++__pw_grp)
+    {
+        if (__pw_trial[__pw_grp] == PW_TRIAL_NULL) continue;
+        pw_group_offset[pw_num_groups + 1] = pw_group_offset[pw_num_groups];
+        for (__pw_evid = 0; __pw_evid < pw_num_ctrs; ++__pw_evid)
+        {
+            if (__pw_group[__pw_evid] != __pw_grp) continue;
+            pw_group_events[pw_group_offset[pw_num_groups + 1]++] = __pw_evid;
+        }
+        ++pw_num_groups;
+        pw_trial_destroy(&__pw_trial[__pw_grp]);
+    }
+    free(__pw_trial);
+    free(__pw_group);
+    free(__pw_moved);
+}
+
+#if defined(PW_GROUPS_FILE) || defined(PW_EVENTS_CACHE)
+/**
+ * @brief Read groups previously planned: one line per group with the names of
+ * its events. Groups are validated before using them
+ *
+ * @param fp Stream where the groups are read from
+ * @return PW_SUCCESS if the plan is usable, PW_ERR otherwise
+ */
+int
+pw_read_groups(FILE *fp)
+{
+    char * line        = NULL;
+    size_t len         = 0;
+    int    nevents     = 0;
+    int    __pw_retval = PW_SUCCESS;
+    int    __pw_evid;
+    int    __pw_grp;
+    int *  seen;
+
+    seen          = (int *)calloc(pw_num_ctrs, sizeof(int));
+    pw_num_groups = 0;
+    while ((__pw_retval == PW_SUCCESS) && (getline(&line, &len, fp) != -1))
+    {
+        char *tok;
+        pw_group_offset[pw_num_groups] = nevents;
+        for (tok = strtok(line, " \t\n"); tok != NULL;
+             tok = strtok(NULL, " \t\n"))
+        {
+            for (__pw_evid = 0; __pw_evid < pw_num_ctrs; ++__pw_evid)
+            {
+                if (strcmp(_pw_eventlist[__pw_evid], tok) == 0) break;
+            }
+            if ((__pw_evid == pw_num_ctrs) || seen[__pw_evid])
+            {
+                __pw_retval = PW_ERR;
+                break;
+            }
+            seen[__pw_evid]            = 1;
+            pw_group_events[nevents++] = __pw_evid;
+        }
+        if (nevents > pw_group_offset[pw_num_groups]) ++pw_num_groups;
+    }
+    pw_group_offset[pw_num_groups] = nevents;
+    if (nevents != pw_num_ctrs) __pw_retval = PW_ERR;
+    for (__pw_grp = 0;
+         (__pw_retval == PW_SUCCESS) && (__pw_grp < pw_num_groups);
+         ++__pw_grp)
+    {
+        if (pw_check_group(__pw_grp) != PAPI_OK) __pw_retval = PW_ERR;
+    }
+    free(line);
+    free(seen);
+    return __pw_retval;
+}
+
+/**
+ * @brief Write the groups planned, in the format read by pw_read_groups
+ *
+ * @param fp Stream where the groups are written
+ */
+void
+pw_write_groups(FILE *fp)
+{
+    int __pw_grp;
+    int __pw_pos;
+
+    for (__pw_grp = 0; __pw_grp < pw_num_groups; ++__pw_grp)
+    {
+        for (__pw_pos = 0; __pw_pos < PW_GRP_SIZE(__pw_grp); ++__pw_pos)
+        {
+            fprintf(fp,
+                    "%s%s",
+                    (__pw_pos == 0) ? "" : " ",
+                    _pw_eventlist[PW_GRP_EVT(__pw_grp, __pw_pos)]);
+        }
+        fprintf(fp, "\n");
+    }
+}
+#endif
+
+#if defined(PW_GROUPS_FILE)
+/**
+ * @brief Load groups previously planned
+ *
+ * @param file Name of the file
+ * @return PW_SUCCESS if the plan is usable, PW_ERR otherwise
+ */
+int
+pw_load_groups(const char *file)
+{
+    FILE *fp = fopen(file, "r");
+    int   __pw_retval;
+
+    if (fp == NULL) return PW_ERR;
+    __pw_retval = pw_read_groups(fp);
+    fclose(fp);
+    return __pw_retval;
+}
+
+/**
+ * @brief Store groups planned for later executions
+ *
+ * @param file Name of the file
+ */
+void
+pw_save_groups(const char *file)
+{
+    FILE *fp = fopen(file, "w");
+
+    if (fp == NULL)
+    {
+        pw_dprintf(PW_D_WARNING, "[WARNING] Groups could not be saved!");
+        return;
+    }
+    pw_write_groups(fp);
+    fclose(fp);
+}
+#endif
+
+#if defined(PW_EVENTS_CACHE)
+/**
+ * @brief Describe the CPU for the key of the events cache: the fields of the
+ * first processor in /proc/cpuinfo identifying its model
+ *
+ * @param fp Stream where the description is written
+ */
+static void
+pw_cache_cpu(FILE *fp)
+{
+    const char *fields[] = {"vendor_id",
+                            "cpu family",
+                            "model",
+                            "model name",
+                            "stepping",
+                            "CPU implementer",
+                            "CPU architecture",
+                            "CPU variant",
+                            "CPU part",
+                            "CPU revision",
+                            NULL};
+    FILE *      cpuinfo  = fopen("/proc/cpuinfo", "r");
+    char *      line     = NULL;
+    size_t      len      = 0;
+    int         k;
+
+    fprintf(fp, "cpu:");
+    if (cpuinfo == NULL)
+    {
+        fprintf(fp, " unknown\n");
+        return;
+    }
+    while ((getline(&line, &len, cpuinfo) != -1) && (line[0] != '\n'))
+    {
+        char *sep = strchr(line, ':');
+        char *end = sep;
+        if (sep == NULL) continue;
+        while ((end > line) && isspace((unsigned char)end[-1])) --end;
+        *end = '\0';
+        for (k = 0; fields[k] != NULL; ++k)
+        {
+            if (strcmp(line, fields[k]) == 0) break;
+        }
+        if (fields[k] == NULL) continue;
+        sep[strcspn(sep + 1, "\n") + 1] = '\0';
+        fprintf(fp, " %s:%s;", line, sep + 1);
+    }
+    fprintf(fp, "\n");
+    free(line);
+    fclose(cpuinfo);
+}
+
+/**
+ * @brief Look up the events cache of the CPU model, PAPI version, options and
+ * list of events. On a hit the codes of the events are taken from the cache:
+ * PAPI may assign the codes of native events per process, so each one is
+ * checked to still name its event, and those which do not are resolved again
+ */
+static void
+pw_cache_load()
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    size_t             len  = 0;
+    FILE *             fp   = open_memstream(&pw_cache_key, &len);
+    char *             buf;
+    char *             c;
+    int                k;
+    int                pos = -1;
+
+    fprintf(fp, "# papi_wrapper events cache\n");
+    pw_cache_cpu(fp);
+#    if defined(PW_BACKEND_PERF)
+    fprintf(fp, "backend: perf_event\n");
+#    else
+    fprintf(fp,
+            "backend: PAPI %d.%d.%d\n",
+            PAPI_VERSION_MAJOR(PAPI_VERSION),
+            PAPI_VERSION_MINOR(PAPI_VERSION),
+            PAPI_VERSION_REVISION(PAPI_VERSION));
+#    endif
+    fprintf(fp, "mode: %d domain: %d\nevents:", PW_EXEC_MODE, PW_DOM);
+    for (k = 0; k < pw_num_ctrs; ++k) fprintf(fp, " %s", _pw_eventlist[k]);
+    fprintf(fp, "\n");
+    fclose(fp);
+
+    /* FNV-1a of the key names the file; the key itself is compared */
+    for (c = pw_cache_key; *c != '\0'; ++c)
+    {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+    snprintf(pw_cache_file,
+             sizeof(pw_cache_file),
+             "%s/__tmp_papi_wrapper.%016llx.events",
+             PW_EVENTS_CACHE,
+             hash);
+    pw_cache_stale = 1;
+    if ((pw_cache_fp = fopen(pw_cache_file, "r")) == NULL)
+    {
+        pw_dprintf(PW_D_LOW, "events cache %s: miss", pw_cache_file);
+        return;
+    }
+    buf = (char *)malloc(len);
+    if ((fread(buf, 1, len, pw_cache_fp) != len)
+        || (memcmp(buf, pw_cache_key, len) != 0)
+        || (fscanf(pw_cache_fp, "codes:%n", &pos) == EOF) || (pos == -1))
+    {
+        pw_dprintf(PW_D_LOW, "events cache %s: mismatch", pw_cache_file);
+        fclose(pw_cache_fp);
+        pw_cache_fp = NULL;
+        free(buf);
+        return;
+    }
+    free(buf);
+    pw_cache_stale = 0;
+    pw_cache_codes = (int *)malloc(sizeof(int) * (pw_num_ctrs + 1));
+    for (k = 0; k < pw_num_ctrs; ++k)
+    {
+        unsigned int code;
+        if (fscanf(pw_cache_fp, "%x", &code) != 1)
+        {
+            pw_cache_stale = 1;
+            fclose(pw_cache_fp);
+            pw_cache_fp = NULL;
+            break;
+        }
+        pw_cache_codes[k] = (int)code;
+#    if !defined(PW_BACKEND_PERF)
+        char name[PAPI_HUGE_STR_LEN];
+        if ((PAPI_event_code_to_name(pw_cache_codes[k], name) == PAPI_OK)
+            && (strcmp(name, _pw_eventlist[k]) == 0))
+            pw_eventlist[k] = pw_cache_codes[k];
+#    endif
+    }
+    pw_dprintf(PW_D_LOW, "events cache %s: hit", pw_cache_file);
+}
+
+/**
+ * @brief Close the events cache, rewriting it if it was missing or its codes
+ * or groups changed. It is written aside and renamed, so concurrent
+ * executions never read it partially written
+ */
+static void
+pw_cache_save()
+{
+    char  tmp[PATH_MAX + 16];
+    FILE *fp;
+    int   k;
+
+    if (pw_cache_fp != NULL) fclose(pw_cache_fp);
+    pw_cache_fp = NULL;
+    for (k = 0; (k < pw_num_ctrs) && !pw_cache_stale; ++k)
+    {
+        if (pw_cache_codes[k] != pw_eventlist[k]) pw_cache_stale = 1;
+    }
+    if (pw_cache_stale)
+    {
+        snprintf(tmp, sizeof(tmp), "%s.%d", pw_cache_file, (int)getpid());
+        if ((fp = fopen(tmp, "w")) != NULL)
+        {
+            fputs(pw_cache_key, fp);
+            fprintf(fp, "codes:");
+            for (k = 0; k < pw_num_ctrs; ++k)
+            {
+                fprintf(fp, " 0x%x", (unsigned int)pw_eventlist[k]);
+            }
+            fprintf(fp, "\n");
+            pw_write_groups(fp);
+        }
+        if ((fp == NULL) || (fclose(fp) != 0)
+            || (rename(tmp, pw_cache_file) != 0))
+        {
+            unlink(tmp);
+            pw_dprintf(PW_D_WARNING,
+                       "[WARNING] Events cache could not be saved!");
+        }
+    }
+    free(pw_cache_key);
+    free(pw_cache_codes);
+    pw_cache_key   = NULL;
+    pw_cache_codes = NULL;
+}
+#endif
+
+/**
+ * @brief Split the list of events in groups, each one measured in a different
+ * execution of the region of interest: one event per group in PW_SNG_EXC mode,
+ * whereas in PW_ALL_EXC mode groups are planned so the number of executions is
+ * minimized. With -DPW_GROUPS_FILE=<file> (or the events cache) the plan is
+ * reused among executions.
+ * In PW_MPX_EXC mode a single group holds all events
+ *
+ * @note When sampling, the overflow handler resets the whole EventSet, so
+ * events are always measured one per group
+ */
+void
+pw_make_groups()
+{
+    int __pw_grp;
+    int __pw_pos;
+#if (PW_EXEC_MODE == PW_ALL_EXC) && !defined(PW_SAMPLING)
+    int __pw_planned = PW_ERR;
+#endif
+
+    pw_group_events = (int *)malloc(sizeof(int) * (pw_num_ctrs + 1));
+    pw_group_offset = (int *)malloc(sizeof(int) * (pw_num_ctrs + 1));
+#if (PW_EXEC_MODE == PW_ALL_EXC) && !defined(PW_SAMPLING)
+#    if defined(PW_MULTITHREAD) && !defined(PW_BACKEND_PERF)
+    /* Trial and error must not abort the execution */
+    PAPI_set_debug(PAPI_QUIET);
+#    endif
+#    if defined(PW_EVENTS_CACHE)
+    if (pw_cache_fp != NULL) __pw_planned = pw_read_groups(pw_cache_fp);
+    if (__pw_planned != PW_SUCCESS) pw_cache_stale = 1;
+#    endif
+#    if defined(PW_GROUPS_FILE)
+    if (__pw_planned != PW_SUCCESS)
+        __pw_planned = pw_load_groups(PW_GROUPS_FILE);
+#    endif
+    if (__pw_planned != PW_SUCCESS)
+    {
+        pw_plan_groups();
+#    if defined(PW_GROUPS_FILE)
+        pw_save_groups(PW_GROUPS_FILE);
+#    endif
+    }
+#    if defined(PW_MULTITHREAD) && !defined(PW_BACKEND_PERF)
+    PAPI_set_debug(PAPI_VERB_ESTOP);
+#    endif
+#elif (PW_EXEC_MODE == PW_MPX_EXC)
+    /* A single group with all events, multiplexed */
+    pw_num_groups      = 1;
+    pw_multiplexing    = 1;
+    pw_group_offset[0] = 0;
+    pw_group_offset[1] = pw_num_ctrs;
+    for (__pw_pos = 0; __pw_pos < pw_num_ctrs; ++__pw_pos)
+    {
+        pw_group_events[__pw_pos] = __pw_pos;
+    }
+#else
+    pw_num_groups = pw_num_ctrs;
+    for (__pw_grp = 0; __pw_grp <= pw_num_ctrs; ++__pw_grp)
+    {
+        pw_group_events[__pw_grp] = __pw_grp;
+        pw_group_offset[__pw_grp] = __pw_grp;
+    }
+#endif
+    pw_dprintf(PW_D_LOW,
+               "pw_num_groups = %d (pw_num_ctrs = %d)",
+               pw_num_groups,
+               pw_num_ctrs);
+    for (__pw_grp = 0; __pw_grp < pw_num_groups; ++__pw_grp)
+    {
+        for (__pw_pos = 0; __pw_pos < PW_GRP_SIZE(__pw_grp); ++__pw_pos)
+        {
+            pw_dprintf(PW_D_LOW,
+                       "group %2d: %s",
+                       __pw_grp,
+                       _pw_eventlist[PW_GRP_EVT(__pw_grp, __pw_pos)]);
+        }
+    }
+}
+
+/**
+ * @brief Register a range of memory of the region of interest, e.g. its
+ * arrays: before each execution it is flushed (PW_CACHE_COLD) or touched
+ * (PW_CACHE_WARM), instead of sweeping the whole last level cache
+ *
+ * @param ptr Start of the range
+ * @param bytes Size of the range
+ * @note Not thread-safe; ranges are registered until pw_close
+ */
+void
+pw_flush_range(void *ptr, size_t bytes)
+{
+    if ((ptr == NULL) || (bytes == 0)) return;
+    pw_ranges = (PW_range_t *)realloc(pw_ranges,
+                                      sizeof(PW_range_t) * (pw_nranges + 1));
+    pw_ranges[pw_nranges].pw_ptr   = (char *)ptr;
+    pw_ranges[pw_nranges].pw_bytes = bytes;
+    ++pw_nranges;
+}
+
+/**
+ * @brief Flush or touch the chunk of each registered range corresponding to
+ * the calling thread, split as a static schedule would do
+ *
+ * @param __pw_nthread Thread number
+ * @param __pw_nthreads Number of threads
+ */
+static void
+pw_prepare_ranges(int __pw_nthread, int __pw_nthreads)
+{
+    const size_t cache_line = 64;
+    int          k;
+
+    for (k = 0; k < pw_nranges; ++k)
+    {
+        size_t chunk = (pw_ranges[k].pw_bytes + __pw_nthreads - 1)
+                       / __pw_nthreads;
+        size_t lo    = chunk * __pw_nthread;
+        size_t hi    = lo + chunk;
+        char * start;
+        char * end;
+
+        if (lo >= pw_ranges[k].pw_bytes) continue;
+        if (hi > pw_ranges[k].pw_bytes) hi = pw_ranges[k].pw_bytes;
+        /* Whole cache lines, even if the range is not aligned */
+        start = (char *)((uintptr_t)(pw_ranges[k].pw_ptr + lo)
+                         & ~(uintptr_t)(cache_line - 1));
+        end   = pw_ranges[k].pw_ptr + hi;
+        if (pw_cache_mode == PW_CACHE_WARM)
+        {
+            volatile char *vp = start;
+            char           sink;
+            for (; (char *)vp < end; vp += cache_line)
+            {
+                sink = *vp;
+            }
+            (void)sink;
+        }
+#if defined(__x86_64__)
+#    if PW_FLUSH == PW_FLUSH_CLFLUSHOPT
+        else if (pw_flush_opt)
+            pw_intel_clflushopt(start, end - start);
+#    endif
+        else
+            pw_intel_clflush(start, end - start);
+#endif
+    }
+}
+
+/**
+ * @brief Prepare the caches of a thread before each execution, depending on
+ * the cache mode. Cold: flush registered ranges (pw_flush_range) or, if none,
+ * sweep the buffers allocated in pw_init with the strategy selected with
+ * -DPW_FLUSH. Warm: touch registered ranges
+ *
+ * @param __pw_nthread Thread number
+ * @param __pw_nthreads Number of threads preparing the caches
+ */
+static void
+pw_prepare_thread(int __pw_nthread, int __pw_nthreads)
+{
+#if defined(__x86_64__)
+    if ((pw_nranges > 0) || (pw_cache_mode == PW_CACHE_WARM))
+#else
+    /* Ranges can only be flushed with clflush */
+    if (pw_cache_mode == PW_CACHE_WARM)
+#endif
+        pw_prepare_ranges(__pw_nthread, __pw_nthreads);
+    else if ((__pw_nthread < pw_flush_nbufs)
+             && (pw_flush_buf[__pw_nthread] != NULL))
+        pw_flush_buffer(pw_flush_buf[__pw_nthread]);
+}
+
+/**
+ * @brief Prepare caches of all threads before each execution (see
+ * pw_prepare_thread). None: nothing
+ *
+ */
+void
+pw_prepare_instruments()
+{
+    if (pw_cache_mode == PW_CACHE_NONE) return;
+#if defined(_OPENMP)
+#    pragma omp parallel
+    {
+        pw_prepare_thread(omp_get_thread_num(), omp_get_num_threads());
+#    pragma omp barrier
+    }
+#else
+    pw_prepare_thread(0, 1);
+#endif
+}
+
+/**
+ * @brief Prepare caches as pw_prepare_instruments, but called by all the
+ * threads of an existing parallel region instead of opening a new one
+ *
+ */
+void
+pw_prepare_instruments_thread()
+{
+    if (pw_cache_mode == PW_CACHE_NONE) return;
+#if defined(_OPENMP)
+    pw_prepare_thread(omp_get_thread_num(), omp_get_num_threads());
+#    pragma omp barrier
+#else
+    pw_prepare_thread(0, 1);
+#endif
+}
+
+/**
+ * @brief Display PAPI errors
+ *
+ * @param file File name
+ * @param line Line where the error occurred
+ * @param call Function called
+ * @param __pw_retval Value returned
+ * @note based on test_fail in papi_utils.c
+ */
+static void
+PW_error(const char *file, int line, const char *call, int __pw_retval)
+{
+    char buf[128];
+
+    memset(buf, '\0', sizeof(buf));
+    if (__pw_retval != 0)
+        fprintf(stdout, "%-40s FAILED\nLine # %d\n", file, line);
+    else
+    {
+        fprintf(stdout, "%-40s SKIPPED\n", file);
+        fprintf(stdout, "Line # %d\n", line);
+    }
+
+    switch (__pw_retval)
+    {
+        case PAPI_ESYS:
+            sprintf(buf, "System error in %s", call);
+            perror(buf);
+            break;
+        default:
+#if defined(PW_BACKEND_PERF)
+            fprintf(stdout,
+                    "Error in %s: %s\n",
+                    call,
+                    (__pw_retval == PAPI_ENOEVNT) ? "Event does not exist"
+                                                  : "Invalid argument");
+#elif defined(PAPI_VERSION)                        \
+    && ((PAPI_VERSION_MAJOR(PAPI_VERSION) == 5     \
+         && PAPI_VERSION_MINOR(PAPI_VERSION) >= 4) \
+        || PAPI_VERSION_MAJOR(PAPI_VERSION) > 5)
+            // PAPI 5.4.3 has changed the API for PAPI_perror.
+            fprintf(
+                stdout, "Error in %s: %s\n", call, PAPI_strerror(__pw_retval));
+#else
+            PAPI_perror(__pw_retval, errstring, PAPI_MAX_STR_LEN);
+            fprintf(stdout, "Error in %s: %s\n", call, errstring);
+#endif
+    }
+    fprintf(stdout, "\n");
+#if !defined(PW_BACKEND_PERF)
+    if (PAPI_is_initialized()) PAPI_shutdown();
+#endif
+    exit(PW_ERR);
+}
+
+#if defined(PW_SAMPLING)
+/**
+ * @brief Keep the address interrupted by an overflow. Only called by the
+ * overflow handler of the thread, so no locks are needed; addresses are
+ * dropped once PW_SAMPLES are kept
+ *
+ * @param __pw_nthread Entry of the thread in PW_thread
+ * @param __pw_evid Event overflowed
+ * @param address Address of the instruction interrupted
+ */
+static inline void
+pw_sample_record(int __pw_nthread, int __pw_evid, void *address)
+{
+    PW_thread_info_t *th = &PW_thread[__pw_nthread];
+    PW_sample_t *     sample;
+
+    if (th->pw_num_samples == PW_SAMPLES)
+    {
+        ++th->pw_samples_dropped;
+        return;
+    }
+    sample               = &th->pw_samples[th->pw_num_samples];
+    sample->pw_addr      = address;
+    sample->pw_evid      = __pw_evid;
+    sample->pw_threshold = th->pw_thresholds[__pw_evid];
+    ++th->pw_num_samples;
+}
+
+/**
+ * @brief Handling event overflow
+ *
+ * @param EventSet Event set which produces the overflow
+ * @param address Address of the instruction interrupted
+ * @param overflow_vector
+ * @param context
+ */
+void
+pw_overflow_handler(int       event_set,
+                    void *    address,
+                    long long overflow_vector,
+                    void *    context)
+{
+    int __pw_retval;
+    int __pw_nthread = pw_thread_id();
+    int __pw_grp     = PW_thread[__pw_nthread].pw_group;
+    int __pw_nidx    = PW_GRP_SIZE(__pw_grp);
+    int __pw_idx[PW_GRP_SIZE(__pw_grp)];
+    int k;
+
+    if ((__pw_retval = PAPI_get_overflow_event_index(
+             event_set, overflow_vector, __pw_idx, &__pw_nidx))
+        != PAPI_OK)
+    {
+        PW_error(
+            __FILE__, __LINE__, "PAPI_get_overflow_event_index", __pw_retval);
+    }
+    for (k = 0; k < __pw_nidx; ++k)
+    {
+        int __pw_evid = PW_GRP_EVT(__pw_grp, __pw_idx[k]);
+        PW_OVRFLW(__pw_nthread, __pw_evid)++;
+        pw_sample_record(__pw_nthread, __pw_evid, address);
+    }
+    if ((__pw_retval = PAPI_reset(event_set)) != PAPI_OK)
+    {
+        PW_error(__FILE__, __LINE__, "PAPI_reset", __pw_retval);
+    }
+}
+#endif
+
+#if !defined(PW_BACKEND_PERF)
+/**
+ * @brief PAPI set options
+ *
+ * @param __pw_nthread Thread number of caller
+ * @param __pw_grp Group of events of the EventSet
+ */
+void
+pw_set_opts(int __pw_nthread, int __pw_grp)
+{
+    int           __pw_retval;
+    PAPI_option_t options;
+    int           evtset = PW_EVTSET(__pw_nthread, __pw_grp);
+
+    /* Domain */
+    memset(&options, 0x0, sizeof(options));
+    options.domain.eventset = evtset;
+    options.domain.domain   = PW_DOM;
+    if ((__pw_retval = PAPI_set_opt(PAPI_DOMAIN, &options)) != PAPI_OK)
+    {
+        pw_dprintf(PW_D_WARNING, "[WARNING] Domain could not be set!");
+    }
+
+    /* Granularity */
+    memset(&options, 0x0, sizeof(options));
+    options.granularity.eventset    = evtset;
+    options.granularity.granularity = PW_GRN;
+    if ((__pw_retval = PAPI_set_opt(PAPI_GRANUL, &options)) != PAPI_OK)
+    {
+        pw_dprintf(PW_D_WARNING, "[WARNING] Granularity could not be set!");
+    }
+}
+#endif
+
+/**
+ * @brief Auxiliary function to concat strings
+ */
+char *
+concat(const char *s1, const char *s2)
+{
+    char *result =
+        malloc(strlen(s1) + strlen(s2) + 1); // +1 for the null-terminator
+    // in real code you would check for errors in malloc here
+    strcpy(result, s1);
+    strcat(result, s2);
+    return result;
+}
+
+/* Core functions */
+
+/**
+ * @brief Create the EventSet of a thread for a group and add all its events
+ *
+ * @param __pw_nthread Entry of the thread in PW_thread
+ * @param __pw_grp Group id
+ */
+static void
+pw_create_eventset(int __pw_nthread, int __pw_grp)
+{
+#if defined(PW_BACKEND_PERF)
+    if ((errno = pw_perf_open(&PW_PERF(__pw_nthread, __pw_grp), __pw_grp))
+        != 0)
+        PW_error(__FILE__, __LINE__, "perf_event_open", PAPI_ESYS);
+#else
+    int               __pw_retval;
+    int               __pw_pos;
+    PAPI_event_info_t evinfo;
+
+#    if defined(PW_USE_PERF)
+    if (pw_perf_open(&PW_PERF(__pw_nthread, __pw_grp), __pw_grp) == 0) return;
+    pw_dprintf(PW_D_LOW,
+               "%2d thread; %2d __pw_grp; perf_event not available, using PAPI",
+               __pw_nthread,
+               __pw_grp);
+#    endif
+    PW_EVTSET(__pw_nthread, __pw_grp) = PAPI_NULL;
+    if ((__pw_retval =
+             PAPI_create_eventset(&(PW_EVTSET(__pw_nthread, __pw_grp))))
+        != PAPI_OK)
+        PW_error(__FILE__, __LINE__, "PAPI_create_eventset", __pw_retval);
+    if (pw_multiplexing)
+    {
+        /* The component must be assigned before enabling multiplexing. PAPI
+         * scales the values of multiplexed EventSets itself */
+        if ((__pw_retval = PAPI_assign_eventset_component(
+                 PW_EVTSET(__pw_nthread, __pw_grp), 0))
+            != PAPI_OK)
+            PW_error(__FILE__,
+                     __LINE__,
+                     "PAPI_assign_eventset_component",
+                     __pw_retval);
+        if ((__pw_retval =
+                 PAPI_set_multiplex(PW_EVTSET(__pw_nthread, __pw_grp)))
+            != PAPI_OK)
+            PW_error(__FILE__, __LINE__, "PAPI_set_multiplex", __pw_retval);
+        pw_dprintf(PW_D_LOW,
+                   "%2d thread; %2d __pw_grp; multiplexed by PAPI",
+                   __pw_nthread,
+                   __pw_grp);
+    }
+    for (__pw_pos = 0; __pw_pos < PW_GRP_SIZE(__pw_grp); ++__pw_pos)
+    {
+        int __pw_evid = PW_GRP_EVT(__pw_grp, __pw_pos);
+        pw_dprintf(PW_D_LOW,
+                   "%2d thread; %2d __pw_grp; adding %s",
+                   __pw_nthread,
+                   __pw_grp,
+                   _pw_eventlist[__pw_evid]);
+        if ((__pw_retval = PAPI_add_event(PW_EVTSET(__pw_nthread, __pw_grp),
+                                          PW_EVTLST(__pw_nthread, __pw_evid)))
+            != PAPI_OK)
+            PW_error(__FILE__, __LINE__, "PAPI_add_event", __pw_retval);
+        if ((__pw_retval = PAPI_get_event_info(
+                 PW_EVTLST(__pw_nthread, __pw_evid), &evinfo))
+            != PAPI_OK)
+            PW_error(__FILE__, __LINE__, "PAPI_get_event_info", __pw_retval);
+    }
+    pw_set_opts(__pw_nthread, __pw_grp);
+#    if defined(PW_SAMPLING)
+    for (__pw_pos = 0; __pw_pos < PW_GRP_SIZE(__pw_grp); ++__pw_pos)
+    {
+        int __pw_evid = PW_GRP_EVT(__pw_grp, __pw_pos);
+        /* Overflow dispatching (signal handler, timers) is process-wide */
+#        if defined(PW_MULTITHREAD)
+#            pragma omp critical(pw_overflow)
+#        endif
+        if ((__pw_retval = PAPI_overflow(PW_EVTSET(__pw_nthread, __pw_grp),
+                                         PW_EVTLST(__pw_nthread, __pw_evid),
+                                         PW_THRESHOLD(__pw_nthread, __pw_evid),
+                                         PW_OVRFLW_TYPE,
+                                         pw_overflow_handler))
+            != PAPI_OK)
+            PW_error(__FILE__, __LINE__, "PAPI_overflow", __pw_retval);
+    }
+#    endif
+#endif
+}
+
+/**
+ * @brief Remove all events of an EventSet and destroy it
+ *
+ * @param __pw_nthread Entry of the thread in PW_thread
+ * @param __pw_grp Group id
+ */
+static void
+pw_destroy_eventset(int __pw_nthread, int __pw_grp)
+{
+    PW_thread[__pw_nthread].pw_group = -1;
+#if defined(PW_USE_PERF)
+    if (PW_PERF(__pw_nthread, __pw_grp).pw_nfds > 0)
+    {
+        pw_perf_close(&PW_PERF(__pw_nthread, __pw_grp));
+        return;
+    }
+#endif
+#if !defined(PW_BACKEND_PERF)
+    int __pw_retval;
+    if ((__pw_retval = PAPI_cleanup_eventset(PW_EVTSET(__pw_nthread, __pw_grp)))
+        != PAPI_OK)
+        PW_error(__FILE__, __LINE__, "PAPI_cleanup_eventset", __pw_retval);
+    if ((__pw_retval =
+             PAPI_destroy_eventset(&(PW_EVTSET(__pw_nthread, __pw_grp))))
+        != PAPI_OK)
+        PW_error(__FILE__, __LINE__, "PAPI_destroy_eventset", __pw_retval);
+#endif
+}
+
+#if defined(PW_PERSISTENT)
+/**
+ * @brief Create the EventSets of a thread for all groups, so they are reused
+ * among executions of the region of interest (-DPW_PERSISTENT)
+ *
+ * @param __pw_nthread Entry of the thread in PW_thread
+ */
+static void
+pw_create_eventsets(int __pw_nthread)
+{
+    int __pw_grp;
+
+    for (__pw_grp = 0; __pw_grp < pw_num_groups; ++__pw_grp)
+    {
+        pw_create_eventset(__pw_nthread, __pw_grp);
+    }
+}
+
+/**
+ * @brief Destroy the EventSets of a thread for all groups (-DPW_PERSISTENT)
+ *
+ * @param __pw_nthread Entry of the thread in PW_thread
+ */
+static void
+pw_destroy_eventsets(int __pw_nthread)
+{
+    int __pw_grp;
+
+    for (__pw_grp = 0; __pw_grp < pw_num_groups; ++__pw_grp)
+    {
+        pw_destroy_eventset(__pw_nthread, __pw_grp);
+    }
+}
+#endif
+
+#if defined(PW_SAMPLING) && defined(PW_SAMPLING_RATE)
+/**
+ * @brief Adapt the thresholds of the events of a group to the overflows per
+ * second of the last execution, for the next one to overflow
+ * PW_SAMPLING_RATE times per second. Thresholds only change between
+ * executions, so values are rebuilt with the threshold they were counted with
+ *
+ * @param __pw_nthread Entry of the thread in PW_thread
+ * @param __pw_grp Group id
+ */
+static void
+pw_adapt_thresholds(int __pw_nthread, int __pw_grp)
+{
+    double secs =
+        (pw_now() - PW_thread[__pw_nthread].pw_sampling_begin) * 1e-9;
+    int __pw_pos;
+
+    if (secs <= 0.0) return;
+    for (__pw_pos = 0; __pw_pos < PW_GRP_SIZE(__pw_grp); ++__pw_pos)
+    {
+        int    __pw_evid = PW_GRP_EVT(__pw_grp, __pw_pos);
+        int    threshold = PW_THRESHOLD(__pw_nthread, __pw_evid);
+        double scale     = PW_OVRFLW(__pw_nthread, __pw_evid)
+                       / (secs * PW_SAMPLING_RATE);
+        double next;
+
+        if (scale > PW_SAMPLING_STEP) scale = PW_SAMPLING_STEP;
+        if (scale < 1.0 / PW_SAMPLING_STEP) scale = 1.0 / PW_SAMPLING_STEP;
+        next = threshold * scale;
+        if (next < PW_SAMPLING_MIN_THRESHOLD) next = PW_SAMPLING_MIN_THRESHOLD;
+        if (next > INT_MAX) next = INT_MAX;
+        if ((int)next == threshold) continue;
+        pw_dprintf(PW_D_LOW,
+                   "thread %d: threshold of %s %d -> %d",
+                   __pw_nthread,
+                   _pw_eventlist[__pw_evid],
+                   threshold,
+                   (int)next);
+        PW_THRESHOLD(__pw_nthread, __pw_evid) = (int)next;
+#    if defined(PW_PERSISTENT)
+        /* EventSets are kept stopped between executions, so the threshold
+         * can be changed in place, once the overflow is disarmed (a
+         * threshold of 0) as PAPI requires */
+        int __pw_retval;
+        int __pw_evtset = PW_EVTSET(__pw_nthread, __pw_grp);
+#        if defined(PW_MULTITHREAD)
+#            pragma omp critical(pw_overflow)
+#        endif
+        {
+            if ((__pw_retval =
+                     PAPI_overflow(__pw_evtset,
+                                   PW_EVTLST(__pw_nthread, __pw_evid),
+                                   0,
+                                   PW_OVRFLW_TYPE,
+                                   pw_overflow_handler))
+                != PAPI_OK)
+                PW_error(__FILE__, __LINE__, "PAPI_overflow", __pw_retval);
+            if ((__pw_retval =
+                     PAPI_overflow(__pw_evtset,
+                                   PW_EVTLST(__pw_nthread, __pw_evid),
+                                   (int)next,
+                                   PW_OVRFLW_TYPE,
+                                   pw_overflow_handler))
+                != PAPI_OK)
+                PW_error(__FILE__, __LINE__, "PAPI_overflow", __pw_retval);
+        }
+#    endif
+    }
+}
+#endif
+
+/**
+ * @brief Start counting all events of a group. With -DPW_PERSISTENT the
+ * EventSet is only reset, it was created in pw_init
+ *
+ * @param __pw_nthread Entry of the thread in PW_thread
+ * @param __pw_grp Group id
+ */
+static void
+pw_start_eventset(int __pw_nthread, int __pw_grp)
+{
+#if defined(PW_SAMPLING)
+    int __pw_pos;
+
+    for (__pw_pos = 0; __pw_pos < PW_GRP_SIZE(__pw_grp); ++__pw_pos)
+    {
+        PW_OVRFLW_RST(__pw_nthread, PW_GRP_EVT(__pw_grp, __pw_pos));
+    }
+#    if defined(PW_SAMPLING_RATE)
+    PW_thread[__pw_nthread].pw_sampling_begin = pw_now();
+#    endif
+#endif
+    PW_thread[__pw_nthread].pw_group = __pw_grp;
+#if defined(PW_TRACE)
+    PW_thread[__pw_nthread].pw_trace.pw_begin = pw_now();
+#endif
+#if defined(PW_USE_PERF)
+    if (PW_PERF(__pw_nthread, __pw_grp).pw_nfds > 0)
+    {
+        pw_perf_start(&PW_PERF(__pw_nthread, __pw_grp));
+        return;
+    }
+#endif
+#if !defined(PW_BACKEND_PERF)
+    int __pw_retval;
+#    if defined(PW_PERSISTENT)
+    if ((__pw_retval = PAPI_reset(PW_EVTSET(__pw_nthread, __pw_grp)))
+        != PAPI_OK)
+        PW_error(__FILE__, __LINE__, "PAPI_reset", __pw_retval);
+#    endif
+    if ((__pw_retval = PAPI_start(PW_EVTSET(__pw_nthread, __pw_grp)))
+        != PAPI_OK)
+        PW_error(__FILE__, __LINE__, "PAPI_start", __pw_retval);
+#endif
+}
+
+/**
+ * @brief Stop counting all events of a group and store their values. A
+ * single PAPI_stop returns the counters of the whole group
+ *
+ * @param __pw_nthread Entry of the thread in PW_thread
+ * @param __pw_grp Group id
+ */
+static void
+pw_stop_eventset(int __pw_nthread, int __pw_grp)
+{
+    int       __pw_pos;
+    long long values[PW_GRP_SIZE(__pw_grp)];
+
+#if defined(PW_BACKEND_PERF)
+    pw_perf_stop(&PW_PERF(__pw_nthread, __pw_grp), values);
+#elif defined(PW_SAMPLING)
+    int __pw_retval;
+    memset(values, 0, sizeof(values));
+    if ((__pw_retval = PAPI_accum(PW_EVTSET(__pw_nthread, __pw_grp), values))
+        != PAPI_OK)
+        PW_error(__FILE__, __LINE__, "PAPI_accum", __pw_retval);
+    if ((__pw_retval = PAPI_stop(PW_EVTSET(__pw_nthread, __pw_grp), NULL))
+        != PAPI_OK)
+        PW_error(__FILE__, __LINE__, "PAPI_stop", __pw_retval);
+#else
+    int __pw_retval;
+#    if defined(PW_USE_PERF)
+    if (PW_PERF(__pw_nthread, __pw_grp).pw_nfds > 0)
+        pw_perf_stop(&PW_PERF(__pw_nthread, __pw_grp), values);
+    else
+#    endif
+        if ((__pw_retval =
+                 PAPI_stop(PW_EVTSET(__pw_nthread, __pw_grp), values))
+            != PAPI_OK)
+        PW_error(__FILE__, __LINE__, "PAPI_stop", __pw_retval);
+#endif
+    for (__pw_pos = 0; __pw_pos < PW_GRP_SIZE(__pw_grp); ++__pw_pos)
+    {
+        int __pw_evid = PW_GRP_EVT(__pw_grp, __pw_pos);
+        PW_VALUES(__pw_nthread, __pw_evid) = values[__pw_pos];
+#if defined(PW_SAMPLING)
+        PW_VALUES(__pw_nthread, __pw_evid) +=
+            (PW_OVRFLW(__pw_nthread, __pw_evid)
+             * PW_THRESHOLD(__pw_nthread, __pw_evid));
+#endif
+#if defined(PW_PERF_MPX)
+        PW_COVERAGE(__pw_nthread, __pw_evid) =
+            (PW_PERF(__pw_nthread, __pw_grp).pw_nfds > 0)
+                ? PW_PERF(__pw_nthread, __pw_grp).pw_coverage[__pw_pos]
+                : NAN;
+#endif
+    }
+#if defined(PW_CALIBRATE)
+    if (pw_calibrating) return;
+#endif
+#if defined(PW_TRACE)
+    pw_trace_append(__pw_nthread,
+                    __pw_grp,
+                    -1,
+                    PW_thread[__pw_nthread].pw_trace.pw_begin,
+                    pw_now(),
+                    values,
+                    NULL);
+#endif
+#if defined(PW_CALIBRATE_SUBTRACT)
+    /* Without the overhead of starting and stopping the counters */
+    for (__pw_pos = 0; __pw_pos < PW_GRP_SIZE(__pw_grp); ++__pw_pos)
+    {
+        int __pw_evid = PW_GRP_EVT(__pw_grp, __pw_pos);
+        PW_VALUES(__pw_nthread, __pw_evid) -=
+            PW_OVERHEAD(__pw_nthread, __pw_evid);
+        if (PW_VALUES(__pw_nthread, __pw_evid) < 0)
+            PW_VALUES(__pw_nthread, __pw_evid) = 0;
+    }
+#endif
+#if defined(PW_SAMPLING) && defined(PW_SAMPLING_RATE)
+    pw_adapt_thresholds(__pw_nthread, __pw_grp);
+#endif
+#if defined(PW_REPETITIONS)
+    pw_record_run(__pw_nthread, __pw_grp);
+#endif
+}
+
+/**
+ * @brief Read all counters of a group without stopping them. With -DPW_RDPMC,
+ * groups counted with perf_event are read in userspace
+ *
+ * @param __pw_nthread Entry of the thread in PW_thread
+ * @param __pw_grp Group id
+ * @param values Values of the events, in the order of the group
+ */
+static inline void
+pw_read_eventset(int __pw_nthread, int __pw_grp, long long *values)
+{
+#if defined(PW_USE_RDPMC)
+    if (PW_PERF(__pw_nthread, __pw_grp).pw_nfds > 0)
+    {
+        pw_perf_rdpmc(&PW_PERF(__pw_nthread, __pw_grp), values);
+        return;
+    }
+#elif defined(PW_USE_PERF) && !defined(PW_BACKEND_PERF)
+    if (PW_PERF(__pw_nthread, __pw_grp).pw_nfds > 0)
+    {
+        pw_perf_read(&PW_PERF(__pw_nthread, __pw_grp), values);
+        return;
+    }
+#endif
+#if defined(PW_BACKEND_PERF)
+    pw_perf_read(&PW_PERF(__pw_nthread, __pw_grp), values);
+#else
+    int __pw_retval;
+    if ((__pw_retval = PAPI_read(PW_EVTSET(__pw_nthread, __pw_grp), values))
+        != PAPI_OK)
+        PW_error(__FILE__, __LINE__, "PAPI_read", __pw_retval);
+#endif
+}
+
+/**
+ * @brief Number of subregions set with pw_init_start_instruments_sub, which
+ * are followed by the ones registered by name
+ */
+static inline int
+pw_num_fixed_subregions()
+{
+    return (__PW_NSUBREGIONS > 0) ? __PW_NSUBREGIONS : 0;
+}
+
+/**
+ * @brief Bytes of the storage of some subregions of a thread: their structs
+ * and the values (and histograms and repetitions) of each one
+ *
+ * @param nsub Number of subregions
+ */
+static size_t
+pw_subregions_size(size_t nsub)
+{
+    size_t bytes = PW_ARENA_ALIGN(sizeof(PW_thread_subregion_t) * nsub)
+                   + nsub * PW_ARENA_ALIGN(sizeof(long long) * pw_num_ctrs);
+#if defined(PW_HISTOGRAM)
+    bytes += nsub * PW_ARENA_ALIGN(sizeof(PW_histogram_t) * pw_num_ctrs);
+#endif
+#if defined(PW_REPETITIONS)
+    bytes += nsub
+             * PW_ARENA_ALIGN(sizeof(long long) * pw_num_ctrs * PW_REPETITIONS);
+#endif
+    return bytes;
+}
+
+/**
+ * @brief Bytes of the storage of each thread: values of the events and of
+ * the subregions (and of each repetition), EventSets (one per group) and
+ * overflows and their addresses or perf_event groups, coverage of
+ * multiplexed events, and overhead of the wrapper
+ */
+static size_t
+pw_thread_block_size()
+{
+    size_t bytes = PW_ARENA_ALIGN(sizeof(long long) * pw_num_ctrs)
+                   + PW_ARENA_ALIGN(sizeof(int) * pw_num_groups)
+                   + pw_subregions_size(pw_num_fixed_subregions());
+#if defined(PW_SAMPLING)
+    bytes += PW_ARENA_ALIGN(sizeof(long long) * pw_num_ctrs)
+             + PW_ARENA_ALIGN(sizeof(int) * pw_num_ctrs)
+             + PW_ARENA_ALIGN(sizeof(PW_sample_t) * PW_SAMPLES);
+#endif
+#if defined(PW_USE_PERF)
+    bytes += PW_ARENA_ALIGN(sizeof(PW_perf_group_t) * pw_num_groups);
+#endif
+#if defined(PW_PERF_MPX)
+    bytes += PW_ARENA_ALIGN(sizeof(double) * pw_num_ctrs);
+#endif
+#if defined(PW_REPETITIONS)
+    bytes +=
+        PW_ARENA_ALIGN(sizeof(long long) * pw_num_ctrs * PW_REPETITIONS);
+#endif
+#if defined(PW_CALIBRATE)
+    bytes += PW_ARENA_ALIGN(sizeof(long long) * pw_num_ctrs * 2);
+#endif
+    return bytes;
+}
+
+/**
+ * @brief Take storage from the block of a thread
+ *
+ * @param cur Cursor within the block, advanced past the storage taken
+ * @param bytes Size requested
+ */
+static inline void *
+pw_block_take(char **cur, size_t bytes)
+{
+    void *ptr = *cur;
+    *cur += PW_ARENA_ALIGN(bytes);
+    return ptr;
+}
+
+/**
+ * @brief Take the storage of some subregions from the block of a thread (see
+ * pw_subregions_size)
+ *
+ * @param cur Cursor within the block, advanced past the storage taken
+ * @param nsub Number of subregions
+ * @return The subregions
+ */
+static PW_thread_subregion_t *
+pw_subregions_take(char **cur, int nsub)
+{
+    PW_thread_subregion_t *subs;
+    int                    subreg;
+
+    if (nsub == 0) return NULL;
+    subs = (PW_thread_subregion_t *)pw_block_take(
+        cur, sizeof(PW_thread_subregion_t) * nsub);
+    for (subreg = 0; subreg < nsub; ++subreg)
+    {
+        subs[subreg].pw_values =
+            (long long *)pw_block_take(cur, sizeof(long long) * pw_num_ctrs);
+#if defined(PW_HISTOGRAM)
+        subs[subreg].pw_hist = (PW_histogram_t *)pw_block_take(
+            cur, sizeof(PW_histogram_t) * pw_num_ctrs);
+#endif
+#if defined(PW_REPETITIONS)
+        subs[subreg].pw_reps = (long long *)pw_block_take(
+            cur, sizeof(long long) * pw_num_ctrs * PW_REPETITIONS);
+#endif
+    }
+    return subs;
+}
+
+/**
+ * @brief Allocate PW_thread, padded to cache lines so threads do not share
+ * them. The storage of each thread is allocated later by pw_alloc_thread
+ *
+ * @param __pw_nthreads Number of entries of PW_thread
+ */
+static void
+pw_alloc_threads(int __pw_nthreads)
+{
+    pw_num_threads = __pw_nthreads;
+    pw_block_size =
+        (pw_thread_block_size() + PW_CACHE_LINE - 1) & ~(PW_CACHE_LINE - 1);
+    if ((PW_thread = (PW_thread_info_t *)aligned_alloc(
+             PW_CACHE_LINE, sizeof(PW_thread_info_t) * __pw_nthreads))
+        == NULL)
+        PW_error(__FILE__, __LINE__, "aligned_alloc", PAPI_ESYS);
+    memset(PW_thread, 0, sizeof(PW_thread_info_t) * __pw_nthreads);
+    pw_dprintf(PW_D_LOW,
+               "pw_block_size = %zu bytes per thread; %d threads",
+               pw_block_size,
+               __pw_nthreads);
+}
+
+/**
+ * @brief Allocate the storage of a thread in a single block aligned to cache
+ * lines. Called by the thread itself, which touches the block first so it
+ * is placed in its NUMA node
+ *
+ * @param __pw_nthread Thread number
+ */
+static void
+pw_alloc_thread(int __pw_nthread)
+{
+    PW_thread_info_t *th = &PW_thread[__pw_nthread];
+    char *            cur;
+
+    if ((th->pw_block = (char *)aligned_alloc(PW_CACHE_LINE, pw_block_size))
+        == NULL)
+        PW_error(__FILE__, __LINE__, "aligned_alloc", PAPI_ESYS);
+    memset(th->pw_block, 0, pw_block_size);
+    cur = th->pw_block;
+    th->pw_values =
+        (long long *)pw_block_take(&cur, sizeof(long long) * pw_num_ctrs);
+    th->pw_eventset = (int *)pw_block_take(&cur, sizeof(int) * pw_num_groups);
+    th->pw_subregions = pw_subregions_take(&cur, pw_num_fixed_subregions());
+    th->pw_group = -1;
+#if defined(PW_SAMPLING)
+    th->pw_overflows =
+        (long long *)pw_block_take(&cur, sizeof(long long) * pw_num_ctrs);
+    int __pw_evid;
+    th->pw_thresholds = (int *)pw_block_take(&cur, sizeof(int) * pw_num_ctrs);
+    for (__pw_evid = 0; __pw_evid < pw_num_ctrs; ++__pw_evid)
+    {
+        th->pw_thresholds[__pw_evid] = _pw_samplinglist[__pw_evid];
+    }
+    th->pw_samples =
+        (PW_sample_t *)pw_block_take(&cur, sizeof(PW_sample_t) * PW_SAMPLES);
+#endif
+#if defined(PW_USE_PERF)
+    th->pw_perf = pw_block_take(&cur, sizeof(PW_perf_group_t) * pw_num_groups);
+#endif
+#if defined(PW_PERF_MPX)
+    th->pw_coverage =
+        (double *)pw_block_take(&cur, sizeof(double) * pw_num_ctrs);
+#endif
+#if defined(PW_REPETITIONS)
+    th->pw_reps = (long long *)pw_block_take(
+        &cur, sizeof(long long) * pw_num_ctrs * PW_REPETITIONS);
+#endif
+#if defined(PW_CALIBRATE)
+    th->pw_overhead =
+        (long long *)pw_block_take(&cur, sizeof(long long) * pw_num_ctrs * 2);
+#endif
+    assert((size_t)(cur - th->pw_block) <= pw_block_size);
+#if defined(PW_TRACE)
+    pw_trace_alloc(__pw_nthread);
+#endif
+}
+
+/**
+ * @brief Hash of the name of a subregion (FNV-1a)
+ *
+ * @param name Name of the subregion
+ */
+static unsigned int
+pw_named_hash(const char *name)
+{
+    unsigned int h = 2166136261u;
+    for (; *name; ++name)
+    {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief Find the slot of a name in the table of named subregions: either
+ * the one holding it or the empty one where it would be inserted
+ *
+ * @param name Name of the subregion
+ */
+static int
+pw_named_slot(const char *name)
+{
+    int slot = pw_named_hash(name) & (pw_named_slots - 1);
+    while ((pw_named_table[slot] != 0)
+           && (strcmp(pw_named_names[pw_named_table[slot] - 1], name) != 0))
+    {
+        slot = (slot + 1) & (pw_named_slots - 1);
+    }
+    return slot;
+}
+
+/**
+ * @brief Find or register a named subregion; only called once per call site
+ * of pw_begin_subregion_named/pw_end_subregion_named, since the handle
+ * returned is cached there
+ *
+ * @param name Name of the subregion
+ * @return Handle of the subregion, for pw_begin_counter_subregion
+ */
+int
+pw_subregion_register(const char *name)
+{
+    int id;
+
+#if defined(_OPENMP)
+#    pragma omp critical(pw_subregion)
+#endif
+    {
+        if (2 * (pw_num_named + 1) > pw_named_slots)
+        {
+            /* Keep the table at most half full */
+            int k;
+            pw_named_slots = (pw_named_slots > 0) ? 2 * pw_named_slots : 64;
+            free(pw_named_table);
+            if ((pw_named_table = (int *)calloc(pw_named_slots, sizeof(int)))
+                == NULL)
+                PW_error(__FILE__, __LINE__, "calloc", PAPI_ESYS);
+            for (k = 0; k < pw_num_named; ++k)
+            {
+                pw_named_table[pw_named_slot(pw_named_names[k])] = k + 1;
+            }
+        }
+        int slot = pw_named_slot(name);
+        if (pw_named_table[slot] == 0)
+        {
+            if (pw_num_named == pw_named_cap)
+            {
+                pw_named_cap   = (pw_named_cap > 0) ? 2 * pw_named_cap : 16;
+                pw_named_names = (char **)realloc(
+                    pw_named_names, sizeof(char *) * pw_named_cap);
+                if (pw_named_names == NULL)
+                    PW_error(__FILE__, __LINE__, "realloc", PAPI_ESYS);
+            }
+            if ((pw_named_names[pw_num_named] = strdup(name)) == NULL)
+                PW_error(__FILE__, __LINE__, "strdup", PAPI_ESYS);
+            pw_named_table[slot]         = pw_num_named + 1;
+            pw_dprintf(PW_D_LOW,
+                       "pw_subregion_register(); %s = %d",
+                       name,
+                       pw_num_fixed_subregions() + pw_num_named);
+            __atomic_store_n(&pw_num_named, pw_num_named + 1, __ATOMIC_RELEASE);
+        }
+        id = pw_num_fixed_subregions() + pw_named_table[slot] - 1;
+    }
+    return id;
+}
+
+/**
+ * @brief Get the values of a subregion of a thread
+ *
+ * @param __pw_nthread Thread number
+ * @param __pw_subreg_n Subregion id
+ * @return The values, NULL for a named subregion the thread never measured
+ */
+static PW_thread_subregion_t *
+pw_subregion(int __pw_nthread, int __pw_subreg_n)
+{
+    PW_thread_info_t *th = &PW_thread[__pw_nthread];
+
+    if (__pw_subreg_n < pw_num_fixed_subregions())
+        return &th->pw_subregions[__pw_subreg_n];
+    __pw_subreg_n -= pw_num_fixed_subregions();
+    if (__pw_subreg_n >= th->pw_named_cap) return NULL;
+    return &th->pw_named[__pw_subreg_n / PW_NAMED_CHUNK]
+                        [__pw_subreg_n % PW_NAMED_CHUNK];
+}
+
+/**
+ * @brief Make room for the values of a named subregion of a thread. Called by
+ * the thread itself before reading the counters, so the allocation is not
+ * measured. Each chunk of PW_NAMED_CHUNK subregions is a block carved as the
+ * one of the thread (see pw_alloc_thread)
+ *
+ * @param __pw_nthread Thread number
+ * @param __pw_subreg_n Subregion id
+ */
+static inline void
+pw_subregion_reserve(int __pw_nthread, int __pw_subreg_n)
+{
+    PW_thread_info_t *th = &PW_thread[__pw_nthread];
+    size_t            bytes;
+    char *            cur;
+
+    __pw_subreg_n -= pw_num_fixed_subregions();
+    if (__pw_subreg_n < th->pw_named_cap) return;
+    bytes = (pw_subregions_size(PW_NAMED_CHUNK) + PW_CACHE_LINE - 1)
+            & ~((size_t)PW_CACHE_LINE - 1);
+    while (__pw_subreg_n >= th->pw_named_cap)
+    {
+        int chunk = th->pw_named_cap / PW_NAMED_CHUNK;
+        if ((th->pw_named = (PW_thread_subregion_t **)realloc(
+                 th->pw_named, sizeof(PW_thread_subregion_t *) * (chunk + 1)))
+            == NULL)
+            PW_error(__FILE__, __LINE__, "realloc", PAPI_ESYS);
+        if ((cur = (char *)aligned_alloc(PW_CACHE_LINE, bytes)) == NULL)
+            PW_error(__FILE__, __LINE__, "aligned_alloc", PAPI_ESYS);
+        memset(cur, 0, bytes);
+        th->pw_named[chunk] = pw_subregions_take(&cur, PW_NAMED_CHUNK);
+        th->pw_named_cap += PW_NAMED_CHUNK;
+    }
+}
+
+#if defined(PW_TRACE)
+/**
+ * @brief Append the record of a call of a subregion to the ring buffer of the
+ * thread, without locks nor allocation. If the drainer did not keep up and
+ * the buffer is full, the record is dropped (and counted)
+ *
+ * @param __pw_nthread Thread number
+ * @param __pw_grp Group measured
+ * @param __pw_subreg_n Subregion id
+ * @param begin Time when the subregion began
+ * @param end Time when the subregion ended
+ * @param values Values of the group when it ended
+ * @param delta Values of the group when it began, NULL if reset
+ */
+static inline void
+pw_trace_append(int                __pw_nthread,
+                int                __pw_grp,
+                int                __pw_subreg_n,
+                unsigned long long begin,
+                unsigned long long end,
+                long long *        values,
+                long long *        delta)
+{
+    PW_trace_ring_t *  ring = &PW_thread[__pw_nthread].pw_trace;
+    unsigned long long head = ring->pw_head;
+    PW_trace_record_t *rec;
+    long long *        vals;
+    int                __pw_pos;
+
+    if (head - __atomic_load_n(&ring->pw_tail, __ATOMIC_ACQUIRE)
+        == PW_TRACE_RECORDS)
+    {
+        ring->pw_dropped++;
+        return;
+    }
+    rec = (PW_trace_record_t *)(ring->pw_records
+                                + (head & (PW_TRACE_RECORDS - 1))
+                                      * pw_trace_size);
+    rec->pw_begin  = begin;
+    rec->pw_end    = end;
+    rec->pw_thread = __pw_nthread;
+    rec->pw_cpu    = sched_getcpu();
+    rec->pw_subreg = __pw_subreg_n;
+    rec->pw_group  = __pw_grp;
+    vals           = (long long *)(rec + 1);
+    for (__pw_pos = 0; __pw_pos < pw_trace_nvals; ++__pw_pos)
+    {
+        vals[__pw_pos] = 0;
+        if (__pw_pos < PW_GRP_SIZE(__pw_grp))
+            vals[__pw_pos] =
+                values[__pw_pos] - ((delta != NULL) ? delta[__pw_pos] : 0);
+    }
+    __atomic_store_n(&ring->pw_head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Write the records of the ring buffer of a thread to the trace
+ *
+ * @param __pw_nthread Thread number
+ */
+static void
+pw_trace_drain(int __pw_nthread)
+{
+    PW_trace_ring_t *  ring = &PW_thread[__pw_nthread].pw_trace;
+    unsigned long long head = __atomic_load_n(&ring->pw_head, __ATOMIC_ACQUIRE);
+    unsigned long long tail = ring->pw_tail;
+
+    while (tail != head)
+    {
+        /* Up to the end of the buffer, then from its beginning */
+        unsigned long long first = tail & (PW_TRACE_RECORDS - 1);
+        unsigned long long count = head - tail;
+        if (count > PW_TRACE_RECORDS - first) count = PW_TRACE_RECORDS - first;
+        fwrite(ring->pw_records + first * pw_trace_size,
+               pw_trace_size,
+               count,
+               pw_trace_fp);
+        tail += count;
+    }
+    __atomic_store_n(&ring->pw_tail, tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Background thread draining the ring buffers once half full
+ *
+ * @param arg Not used
+ */
+static void *
+pw_trace_drainer_loop(void *arg)
+{
+    int th;
+
+    (void)arg;
+    while (!__atomic_load_n(&pw_trace_stop, __ATOMIC_ACQUIRE))
+    {
+        for (th = 0; th < pw_num_threads; ++th)
+        {
+            PW_trace_ring_t *ring = &PW_thread[th].pw_trace;
+            if (__atomic_load_n(&ring->pw_head, __ATOMIC_ACQUIRE)
+                    - ring->pw_tail
+                >= PW_TRACE_RECORDS / 2)
+                pw_trace_drain(th);
+        }
+        usleep(PW_TRACE_POLL_US);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Open the trace and start the drainer. The trace begins with a
+ * header: "PWTRACE" and version (8 + 4 bytes), number of events, of values
+ * per record and of groups (4 bytes each), names of the events (NUL
+ * terminated), and size and events of each group (4 bytes each)
+ */
+static void
+pw_trace_open()
+{
+    const char magic[8] = "PWTRACE";
+    int32_t    header[4];
+    int        __pw_grp;
+    int        __pw_evid;
+    int        __pw_retval;
+
+    pw_trace_nvals = 0;
+    for (__pw_grp = 0; __pw_grp < pw_num_groups; ++__pw_grp)
+    {
+        if (PW_GRP_SIZE(__pw_grp) > pw_trace_nvals)
+            pw_trace_nvals = PW_GRP_SIZE(__pw_grp);
+    }
+    pw_trace_size =
+        sizeof(PW_trace_record_t) + sizeof(long long) * pw_trace_nvals;
+    if ((pw_trace_fp = fopen(PW_TRACE_FILENAME, "wb")) == NULL)
+        PW_error(__FILE__, __LINE__, "fopen: " PW_TRACE_FILENAME, PAPI_ESYS);
+    header[0] = 1;
+    header[1] = pw_num_ctrs;
+    header[2] = pw_trace_nvals;
+    header[3] = pw_num_groups;
+    fwrite(magic, sizeof(magic), 1, pw_trace_fp);
+    fwrite(header, sizeof(header), 1, pw_trace_fp);
+    for (__pw_evid = 0; __pw_evid < pw_num_ctrs; ++__pw_evid)
+    {
+        fwrite(_pw_eventlist[__pw_evid],
+               strlen(_pw_eventlist[__pw_evid]) + 1,
+               1,
+               pw_trace_fp);
+    }
+    for (__pw_grp = 0; __pw_grp < pw_num_groups; ++__pw_grp)
+    {
+        int32_t size = PW_GRP_SIZE(__pw_grp);
+        fwrite(&size, sizeof(size), 1, pw_trace_fp);
+        for (__pw_evid = 0; __pw_evid < size; ++__pw_evid)
+        {
+            int32_t evid = PW_GRP_EVT(__pw_grp, __pw_evid);
+            fwrite(&evid, sizeof(evid), 1, pw_trace_fp);
+        }
+    }
+    pw_trace_stop = 0;
+    if ((__pw_retval = pthread_create(
+             &pw_trace_drainer, NULL, pw_trace_drainer_loop, NULL))
+        != 0)
+        PW_error(__FILE__, __LINE__, "pthread_create", PAPI_ESYS);
+}
+
+/**
+ * @brief Allocate the ring buffer of the calling thread, touching it first
+ *
+ * @param __pw_nthread Thread number
+ */
+static void
+pw_trace_alloc(int __pw_nthread)
+{
+    PW_trace_ring_t *ring  = &PW_thread[__pw_nthread].pw_trace;
+    size_t           bytes = PW_TRACE_RECORDS * pw_trace_size;
+
+    bytes = (bytes + PW_CACHE_LINE - 1) & ~((size_t)PW_CACHE_LINE - 1);
+    if ((ring->pw_records = (char *)aligned_alloc(PW_CACHE_LINE, bytes))
+        == NULL)
+        PW_error(__FILE__, __LINE__, "aligned_alloc", PAPI_ESYS);
+    memset(ring->pw_records, 0, bytes);
+}
+
+/**
+ * @brief Read a NUL terminated string of a trace
+ *
+ * @param data Contents of the trace
+ * @param size Size of the trace
+ * @param off Offset of the string, advanced past it
+ * @return The string, NULL if truncated
+ */
+static const char *
+pw_trace_string(const char *data, size_t size, size_t *off)
+{
+    const char *str = data + *off;
+    const char *nul = memchr(str, '\0', size - *off);
+
+    if (nul == NULL) return NULL;
+    *off = nul - data + 1;
+    return str;
+}
+
+/**
+ * @brief Write a string escaped for JSON
+ *
+ * @param fp File
+ * @param str String
+ */
+static void
+pw_json_string(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (; *str; ++str)
+    {
+        if ((*str == '"') || (*str == '\\'))
+            fprintf(fp, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(fp, "\\u%04x", *str);
+        else
+            fputc(*str, fp);
+    }
+    fputc('"', fp);
+}
+
+/**
+ * @brief Export a trace (see pw_trace_open and pw_trace_close) to the Chrome
+ * trace event format, viewable in Perfetto or chrome://tracing: each thread
+ * is a track where executions of the region of interest and calls of
+ * subregions are nested slices, with the values of the events as arguments.
+ * Each thread also has a counter track per event, with the events per
+ * microsecond of the innermost slices
+ *
+ * @param trace Trace written with -DPW_TRACE
+ * @param json File to write
+ * @return PW_SUCCESS if exported, PW_ERR otherwise
+ */
+int
+pw_trace_export(const char *trace, const char *json)
+{
+    FILE *              fp;
+    char *              data = NULL;
+    size_t              size = 0, off, rec_off, k;
+    int32_t             header[4];
+    const char **       events = NULL;
+    int32_t **          groups = NULL;
+    const char **       subs   = NULL;
+    int32_t             nsub   = 0;
+    size_t              rec_size;
+    unsigned long long  t0 = ~0ULL;
+    long long           nthreads = 0;
+    unsigned long long *prev     = NULL;
+    int                 ret      = PW_ERR;
+    int                 first    = 1;
+
+    if ((fp = fopen(trace, "rb")) == NULL) return PW_ERR;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data = (char *)malloc(size + 1);
+    if (fread(data, 1, size, fp) != size) size = 0;
+    fclose(fp);
+    if ((size < 8 + sizeof(header)) || (memcmp(data, "PWTRACE", 8) != 0))
+        goto out;
+    memcpy(header, data + 8, sizeof(header));
+    if ((header[1] < 0) || (header[2] < 0) || (header[3] < 0)) goto out;
+    off      = 8 + sizeof(header);
+    rec_size = sizeof(PW_trace_record_t) + sizeof(long long) * header[2];
+    events   = (const char **)calloc(header[1], sizeof(char *));
+    groups   = (int32_t **)calloc(header[3], sizeof(int32_t *));
+    for (k = 0; k < (size_t)header[1]; ++k)
+    {
+        if ((events[k] = pw_trace_string(data, size, &off)) == NULL) goto out;
+    }
+    for (k = 0; k < (size_t)header[3]; ++k)
+    {
+        int32_t gsize;
+        if (off + sizeof(int32_t) > size) goto out;
+        memcpy(&gsize, data + off, sizeof(int32_t));
+        if ((gsize < 0) || (gsize > header[2])
+            || (off + sizeof(int32_t) * (gsize + 1) > size))
+            goto out;
+        groups[k] = (int32_t *)(data + off);
+        off += sizeof(int32_t) * (gsize + 1);
+        /* Events of the group, as indices of the names */
+        for (int32_t pos = 0; pos < gsize; ++pos)
+        {
+            if ((groups[k][pos + 1] < 0) || (groups[k][pos + 1] >= header[1]))
+                goto out;
+        }
+    }
+    /* Find the end of the records, their first time and number of threads */
+    for (rec_off = off;; rec_off += rec_size)
+    {
+        PW_trace_record_t rec;
+        if (rec_off + rec_size > size) goto out;
+        memcpy(&rec, data + rec_off, sizeof(rec));
+        if (rec.pw_thread == -1) break;
+        if (rec.pw_begin < t0) t0 = rec.pw_begin;
+        if (rec.pw_thread >= nthreads) nthreads = rec.pw_thread + 1;
+    }
+    k = rec_off + rec_size;
+    if (k + sizeof(int32_t) > size) goto out;
+    memcpy(&nsub, data + k, sizeof(int32_t));
+    k += sizeof(int32_t);
+    subs = (const char **)calloc(nsub + 1, sizeof(char *));
+    for (int32_t s = 0; s < nsub; ++s)
+    {
+        if ((subs[s] = pw_trace_string(data, size, &k)) == NULL) goto out;
+    }
+
+    if ((fp = fopen(json, "w")) == NULL) goto out;
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (long long th = 0; th < nthreads; ++th)
+    {
+        fprintf(fp,
+                "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":0,"
+                "\"tid\":%lld,\"args\":{\"name\":\"PAPI thread %lld\"}}",
+                first ? "" : ",\n",
+                th,
+                th);
+        first = 0;
+    }
+    prev = (unsigned long long *)calloc(nthreads, sizeof(unsigned long long));
+    for (; off < rec_off; off += rec_size)
+    {
+        PW_trace_record_t rec;
+        long long         vals[header[2] > 0 ? header[2] : 1];
+        int32_t *         grp;
+        double            ts, dur;
+        int               leaf;
+        char              name[PW_PATH_MAX];
+        memcpy(&rec, data + off, sizeof(rec));
+        memcpy(vals, data + off + sizeof(rec), sizeof(long long) * header[2]);
+        if ((rec.pw_thread < 0) || (rec.pw_group < 0)
+            || (rec.pw_group >= header[3]) || (rec.pw_subreg < -1)
+            || (rec.pw_subreg >= nsub))
+            continue;
+        grp = groups[rec.pw_group];
+        ts  = (rec.pw_begin - t0) / 1e3;
+        dur = (rec.pw_end - rec.pw_begin) / 1e3;
+        fprintf(fp, ",\n{\"ph\":\"X\",\"name\":");
+        pw_json_string(fp,
+                       (rec.pw_subreg == -1) ? "region of interest"
+                                             : subs[rec.pw_subreg]);
+        fprintf(fp,
+                ",\"cat\":\"group %d\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,"
+                "\"dur\":%.3f,\"args\":{\"cpu\":%d",
+                rec.pw_group,
+                rec.pw_thread,
+                ts,
+                dur,
+                rec.pw_cpu);
+        for (int32_t pos = 0; pos < grp[0]; ++pos)
+        {
+            fputc(',', fp);
+            pw_json_string(fp, events[grp[pos + 1]]);
+            fprintf(fp, ":%lld", vals[pos]);
+        }
+        fprintf(fp, "}}");
+        /* Records are written when slices end, so a slice has slices nested
+         * in it if the previous one of its thread began after it */
+        leaf = (prev[rec.pw_thread] == 0)
+               || (prev[rec.pw_thread] < rec.pw_begin);
+        prev[rec.pw_thread] = rec.pw_begin;
+        if (!leaf || (dur <= 0)) continue;
+        for (int32_t pos = 0; pos < grp[0]; ++pos)
+        {
+            snprintf(name,
+                     sizeof(name),
+                     "%s (thread %d)",
+                     events[grp[pos + 1]],
+                     rec.pw_thread);
+            fprintf(fp, ",\n{\"ph\":\"C\",\"name\":");
+            pw_json_string(fp, name);
+            fprintf(fp,
+                    ",\"pid\":0,\"ts\":%.3f,\"args\":{\"per us\":%.3f}}",
+                    ts,
+                    vals[pos] / dur);
+            fprintf(fp, ",\n{\"ph\":\"C\",\"name\":");
+            pw_json_string(fp, name);
+            fprintf(fp,
+                    ",\"pid\":0,\"ts\":%.3f,\"args\":{\"per us\":0}}",
+                    ts + dur);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    ret = PW_SUCCESS;
+out:
+    free(prev);
+    free(subs);
+    free(groups);
+    free(events);
+    free(data);
+    return ret;
+}
+
+/**
+ * @brief Stop the drainer, write the remaining records and close the trace.
+ * Records end with one whose thread is -1, followed by the number of
+ * subregions (4 bytes), their names (NUL terminated; the number of the ones
+ * set with pw_init_start_instruments_sub) and the records dropped (8 bytes)
+ */
+static void
+pw_trace_close()
+{
+    char *  end = (char *)calloc(1, pw_trace_size);
+    int32_t nsub;
+    int64_t dropped = 0;
+    int     th;
+    int     k;
+
+    __atomic_store_n(&pw_trace_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(pw_trace_drainer, NULL);
+    for (th = 0; th < pw_num_threads; ++th)
+    {
+        pw_trace_drain(th);
+        dropped += PW_thread[th].pw_trace.pw_dropped;
+        free(PW_thread[th].pw_trace.pw_records);
+    }
+    ((PW_trace_record_t *)end)->pw_thread = -1;
+    fwrite(end, pw_trace_size, 1, pw_trace_fp);
+    free(end);
+    nsub = pw_num_fixed_subregions() + pw_num_named;
+    fwrite(&nsub, sizeof(nsub), 1, pw_trace_fp);
+    for (k = 0; k < nsub; ++k)
+    {
+        char        buf[16];
+        const char *name = buf;
+        if (k >= pw_num_fixed_subregions())
+            name = pw_named_names[k - pw_num_fixed_subregions()];
+        else
+            snprintf(buf, sizeof(buf), "%d", k);
+        fwrite(name, strlen(name) + 1, 1, pw_trace_fp);
+    }
+    fwrite(&dropped, sizeof(dropped), 1, pw_trace_fp);
+    fclose(pw_trace_fp);
+    pw_trace_fp = NULL;
+    if (dropped > 0)
+        pw_dprintf(PW_D_WARNING,
+                   "[WARNING] %lld records of the trace dropped!",
+                   (long long)dropped);
+#    if defined(PW_TRACE_JSON)
+    if (pw_trace_export(PW_TRACE_FILENAME, PW_TRACE_JSON) != PW_SUCCESS)
+        PW_error(__FILE__, __LINE__, "pw_trace_export", PAPI_EINVAL);
+#    endif
+}
+#endif
+
+#if defined(PW_SAMPLING)
+/**
+ * @brief Map a module to read its symbol table, once per module
+ *
+ * @param path Path of the module
+ * @return Mapping of the module, with a NULL pw_map if it cannot be read
+ */
+static PW_elf_t *
+pw_elf_map(const char *path)
+{
+    PW_elf_t *  elf;
+    struct stat st;
+    int         fd;
+    int         k;
+
+    for (k = 0; k < pw_nelfs; ++k)
+    {
+        if (strcmp(pw_elfs[k].pw_path, path) == 0) return &pw_elfs[k];
+    }
+    pw_elfs = (PW_elf_t *)realloc(pw_elfs, sizeof(PW_elf_t) * (pw_nelfs + 1));
+    elf     = &pw_elfs[pw_nelfs++];
+    elf->pw_path = strdup(path);
+    elf->pw_map  = NULL;
+    elf->pw_size = 0;
+    if ((fd = open(path, O_RDONLY)) < 0) return elf;
+    if ((fstat(fd, &st) == 0) && ((size_t)st.st_size >= sizeof(ElfW(Ehdr))))
+    {
+        elf->pw_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (elf->pw_map == MAP_FAILED)
+            elf->pw_map = NULL;
+        else
+            elf->pw_size = st.st_size;
+    }
+    close(fd);
+    return elf;
+}
+
+/**
+ * @brief Unmap all modules mapped by pw_elf_map
+ */
+static void
+pw_elf_unmap()
+{
+    int k;
+
+    for (k = 0; k < pw_nelfs; ++k)
+    {
+        if (pw_elfs[k].pw_map != NULL)
+            munmap(pw_elfs[k].pw_map, pw_elfs[k].pw_size);
+        free(pw_elfs[k].pw_path);
+    }
+    free(pw_elfs);
+    pw_elfs  = NULL;
+    pw_nelfs = 0;
+}
+
+/**
+ * @brief Find the function containing an address in the symbol table of its
+ * module, for the functions not exported (thus not found by dladdr)
+ *
+ * @param spot Hotspot whose pw_addr, pw_module and pw_base are set; pw_name
+ * and pw_func are set if found
+ */
+static void
+pw_elf_symbol(PW_hotspot_t *spot)
+{
+    PW_elf_t *        elf = pw_elf_map(spot->pw_module);
+    const char *      map = (const char *)elf->pw_map;
+    const ElfW(Ehdr) *ehdr;
+    const ElfW(Shdr) *shdr;
+    uintptr_t         off;
+    int               k;
+
+    if (map == NULL) return;
+    ehdr = (const ElfW(Ehdr) *)map;
+    if ((memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0)
+        || (ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr)) > elf->pw_size))
+        return;
+    shdr = (const ElfW(Shdr) *)(map + ehdr->e_shoff);
+    /* Symbols of executables not built as PIE hold absolute addresses */
+    off = (uintptr_t)spot->pw_addr;
+    if (ehdr->e_type != ET_EXEC) off -= (uintptr_t)spot->pw_base;
+    for (k = 0; k < ehdr->e_shnum; ++k)
+    {
+        const ElfW(Shdr) *strs;
+        const ElfW(Sym) * sym;
+        size_t            nsym;
+        size_t            j;
+
+        if ((shdr[k].sh_type != SHT_SYMTAB)
+            || (shdr[k].sh_link >= ehdr->e_shnum)
+            || (shdr[k].sh_offset + shdr[k].sh_size > elf->pw_size))
+            continue;
+        strs = &shdr[shdr[k].sh_link];
+        if (strs->sh_offset + strs->sh_size > elf->pw_size) continue;
+        sym  = (const ElfW(Sym) *)(map + shdr[k].sh_offset);
+        nsym = shdr[k].sh_size / sizeof(ElfW(Sym));
+        for (j = 0; j < nsym; ++j)
+        {
+            if ((ELF64_ST_TYPE(sym[j].st_info) == STT_FUNC)
+                && (off >= sym[j].st_value)
+                && (off < sym[j].st_value + sym[j].st_size)
+                && (sym[j].st_name < strs->sh_size))
+            {
+                spot->pw_name = map + strs->sh_offset + sym[j].st_name;
+                spot->pw_func =
+                    (char *)spot->pw_addr - (off - sym[j].st_value);
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Find the function and the module of the address of a hotspot: with
+ * dladdr, or in the symbol table of the module for functions not exported
+ *
+ * @param spot Hotspot whose pw_addr is set
+ */
+static void
+pw_hotspot_symbol(PW_hotspot_t *spot)
+{
+    Dl_info info;
+
+    spot->pw_func   = NULL;
+    spot->pw_base   = NULL;
+    spot->pw_name   = NULL;
+    spot->pw_module = "??";
+    if (dladdr(spot->pw_addr, &info) == 0) return;
+    spot->pw_base = info.dli_fbase;
+    /* The main program may not be named */
+    spot->pw_module = ((info.dli_fname != NULL) && (info.dli_fname[0] != '\0'))
+                          ? info.dli_fname
+                          : "/proc/self/exe";
+    if (info.dli_sname != NULL)
+    {
+        spot->pw_name = info.dli_sname;
+        spot->pw_func = info.dli_saddr;
+    }
+    else
+    {
+        pw_elf_symbol(spot);
+    }
+}
+
+/**
+ * @brief Order hotspots by address
+ */
+static int
+pw_hotspot_by_addr(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)((const PW_hotspot_t *)a)->pw_addr;
+    uintptr_t y = (uintptr_t)((const PW_hotspot_t *)b)->pw_addr;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Order hotspots by number of events, descending
+ */
+static int
+pw_hotspot_by_events(const void *a, const void *b)
+{
+    long long x = ((const PW_hotspot_t *)a)->pw_events;
+    long long y = ((const PW_hotspot_t *)b)->pw_events;
+    return (x < y) - (x > y);
+}
+
+/**
+ * @brief Merge the hotspots with the same address, adding up their overflows
+ * and events
+ *
+ * @param spots Hotspots, sorted by address
+ * @param n Number of hotspots
+ * @return Number of hotspots left
+ */
+static int
+pw_hotspot_merge(PW_hotspot_t *spots, int n)
+{
+    int nspots = 0;
+    int k;
+
+    for (k = 0; k < n; ++k)
+    {
+        if ((nspots > 0) && (spots[nspots - 1].pw_addr == spots[k].pw_addr))
+        {
+            spots[nspots - 1].pw_count += spots[k].pw_count;
+            spots[nspots - 1].pw_events += spots[k].pw_events;
+        }
+        else
+            spots[nspots++] = spots[k];
+    }
+    return nspots;
+}
+
+/**
+ * @brief Write the hotspots of each event sampled: the functions and the
+ * addresses where most of its events occurred in all threads, estimated from
+ * its overflows and the thresholds then
+ *
+ * @param filename File written
+ */
+static void
+pw_write_hotspots(const char *filename)
+{
+    FILE *        fp;
+    PW_hotspot_t *spots;
+    PW_hotspot_t *funcs;
+    long long     dropped = 0;
+    int           total   = 0;
+    int           __pw_evid;
+    int           th;
+    int           k;
+
+    for (th = 0; th < pw_num_threads; ++th)
+    {
+        total += PW_thread[th].pw_num_samples;
+        dropped += PW_thread[th].pw_samples_dropped;
+    }
+    if ((fp = fopen(filename, "w")) == NULL)
+        PW_error(__FILE__, __LINE__, concat("fopen: ", filename), PAPI_ESYS);
+    spots = (PW_hotspot_t *)malloc(sizeof(PW_hotspot_t) * (total + 1));
+    funcs = (PW_hotspot_t *)malloc(sizeof(PW_hotspot_t) * (total + 1));
+    for (__pw_evid = 0; __pw_evid < pw_num_ctrs; ++__pw_evid)
+    {
+        long long events = 0;
+        int       n      = 0;
+        int       nspots;
+        int       nfuncs;
+
+        for (th = 0; th < pw_num_threads; ++th)
+        {
+            for (k = 0; k < PW_thread[th].pw_num_samples; ++k)
+            {
+                PW_sample_t *sample = &PW_thread[th].pw_samples[k];
+                if (sample->pw_evid != __pw_evid) continue;
+                spots[n].pw_addr     = sample->pw_addr;
+                spots[n].pw_count    = 1;
+                spots[n++].pw_events = sample->pw_threshold;
+                events += sample->pw_threshold;
+            }
+        }
+        if (n == 0) continue;
+#    if defined(PW_SAMPLING_RATE)
+        fprintf(fp,
+                "== BEGIN HOTSPOTS %s (adaptive threshold, %d samples) ==\n",
+                _pw_eventlist[__pw_evid],
+                n);
+#    else
+        fprintf(fp,
+                "== BEGIN HOTSPOTS %s (threshold %d, %d samples) ==\n",
+                _pw_eventlist[__pw_evid],
+                _pw_samplinglist[__pw_evid],
+                n);
+#    endif
+        qsort(spots, n, sizeof(PW_hotspot_t), pw_hotspot_by_addr);
+        nspots = pw_hotspot_merge(spots, n);
+        for (k = 0; k < nspots; ++k)
+        {
+            pw_hotspot_symbol(&spots[k]);
+            funcs[k] = spots[k];
+            /* Unknown functions of a module are merged into a single one */
+            funcs[k].pw_addr = (funcs[k].pw_func != NULL) ? funcs[k].pw_func
+                                                          : funcs[k].pw_base;
+        }
+        qsort(spots, nspots, sizeof(PW_hotspot_t), pw_hotspot_by_events);
+        qsort(funcs, nspots, sizeof(PW_hotspot_t), pw_hotspot_by_addr);
+        nfuncs = pw_hotspot_merge(funcs, nspots);
+        qsort(funcs, nfuncs, sizeof(PW_hotspot_t), pw_hotspot_by_events);
+        fprintf(fp, "functions:\n");
+        for (k = 0; (k < nfuncs) && (k < PW_HOTSPOTS_TOP); ++k)
+        {
+            fprintf(fp,
+                    "%6.2f%% %10lld  %s  (%s)\n",
+                    100.0 * funcs[k].pw_events / events,
+                    funcs[k].pw_count,
+                    (funcs[k].pw_name != NULL) ? funcs[k].pw_name : "??",
+                    funcs[k].pw_module);
+        }
+        fprintf(fp, "addresses:\n");
+        for (k = 0; (k < nspots) && (k < PW_HOTSPOTS_TOP); ++k)
+        {
+            PW_hotspot_t *spot = &spots[k];
+            char          sym[PW_PATH_MAX] = "??";
+            if (spot->pw_name != NULL)
+                snprintf(sym,
+                         sizeof(sym),
+                         "%s+0x%lx",
+                         spot->pw_name,
+                         (unsigned long)((char *)spot->pw_addr
+                                         - (char *)spot->pw_func));
+            fprintf(fp,
+                    "%6.2f%% %10lld  %p  %s  (%s+0x%lx)\n",
+                    100.0 * spot->pw_events / events,
+                    spot->pw_count,
+                    spot->pw_addr,
+                    sym,
+                    spot->pw_module,
+                    (unsigned long)((char *)spot->pw_addr
+                                    - (char *)spot->pw_base));
+        }
+        fprintf(fp, "== END HOTSPOTS %s ==\n", _pw_eventlist[__pw_evid]);
+    }
+    fclose(fp);
+    free(spots);
+    free(funcs);
+    pw_elf_unmap();
+    if (dropped > 0)
+        pw_dprintf(PW_D_WARNING,
+                   "[WARNING] %lld overflow addresses dropped!",
+                   dropped);
+}
+#endif
+
+/**
+ * @brief Open a subregion nested in the innermost one open in a thread: find
+ * or add its node in the tree and push it
+ *
+ * @param __pw_nthread Thread number
+ * @param __pw_subreg_n Subregion id
+ * @return Buffer to store the values of the counters when it begins
+ */
+static long long *
+pw_tree_push(int __pw_nthread, int __pw_subreg_n)
+{
+    PW_subregion_tree_t *tree = &PW_thread[__pw_nthread].pw_tree;
+    int                  parent;
+    int                  node;
+    int                  last = -1;
+
+    if (tree->pw_num_nodes == 0)
+    {
+        /* Root */
+        tree->pw_nodes_cap = 16;
+        tree->pw_nodes     = (PW_subregion_node_t *)malloc(
+            sizeof(PW_subregion_node_t) * tree->pw_nodes_cap);
+        tree->pw_nodes[0] = (PW_subregion_node_t){-1, -1, -1, -1, 0, NULL};
+        tree->pw_num_nodes = 1;
+    }
+    parent = (tree->pw_depth > 0) ? tree->pw_stack[tree->pw_depth - 1] : 0;
+    for (node = tree->pw_nodes[parent].pw_child; node != -1;
+         node = tree->pw_nodes[node].pw_sibling)
+    {
+        if (tree->pw_nodes[node].pw_subreg == __pw_subreg_n) break;
+        last = node;
+    }
+    if (node == -1)
+    {
+        if (tree->pw_num_nodes == tree->pw_nodes_cap)
+        {
+            tree->pw_nodes_cap *= 2;
+            tree->pw_nodes = (PW_subregion_node_t *)realloc(
+                tree->pw_nodes,
+                sizeof(PW_subregion_node_t) * tree->pw_nodes_cap);
+        }
+        node                 = tree->pw_num_nodes++;
+        tree->pw_nodes[node] = (PW_subregion_node_t){
+            __pw_subreg_n,
+            parent,
+            -1,
+            -1,
+            0,
+            (long long *)calloc(pw_num_ctrs, sizeof(long long))};
+#if defined(PW_REPETITIONS)
+        tree->pw_nodes[node].pw_reps = (long long *)calloc(
+            (pw_num_ctrs + 1) * PW_REPETITIONS, sizeof(long long));
+#endif
+        if (last == -1)
+            tree->pw_nodes[parent].pw_child = node;
+        else
+            tree->pw_nodes[last].pw_sibling = node;
+    }
+    if (tree->pw_depth == tree->pw_stack_cap)
+    {
+        int k;
+        tree->pw_stack_cap = (tree->pw_stack_cap > 0) ? 2 * tree->pw_stack_cap
+                                                      : 8;
+        tree->pw_stack     = (int *)realloc(tree->pw_stack,
+                                        sizeof(int) * tree->pw_stack_cap);
+        tree->pw_deltas    = (long long **)realloc(
+            tree->pw_deltas, sizeof(long long *) * tree->pw_stack_cap);
+#if defined(PW_TRACE)
+        tree->pw_begins = (unsigned long long *)realloc(
+            tree->pw_begins, sizeof(unsigned long long) * tree->pw_stack_cap);
+#endif
+        for (k = tree->pw_depth; k < tree->pw_stack_cap; ++k)
+        {
+            tree->pw_deltas[k] =
+                (long long *)malloc(sizeof(long long) * pw_num_ctrs);
+        }
+    }
+    tree->pw_stack[tree->pw_depth] = node;
+    return tree->pw_deltas[tree->pw_depth++];
+}
+
+/**
+ * @brief Free the tree of nested subregions of a thread
+ *
+ * @param tree Tree of the thread
+ */
+static void
+pw_tree_free(PW_subregion_tree_t *tree)
+{
+    int k;
+
+    for (k = 0; k < tree->pw_num_nodes; ++k)
+    {
+        free(tree->pw_nodes[k].pw_values);
+#if defined(PW_REPETITIONS)
+        free(tree->pw_nodes[k].pw_reps);
+#endif
+    }
+    for (k = 0; k < tree->pw_stack_cap; ++k)
+    {
+        free(tree->pw_deltas[k]);
+    }
+    free(tree->pw_nodes);
+    free(tree->pw_stack);
+    free(tree->pw_deltas);
+#if defined(PW_TRACE)
+    free(tree->pw_begins);
 #endif
-    int __pw_retval;
+    memset(tree, 0, sizeof(PW_subregion_tree_t));
+}
+
+/**
+ * @brief Read a list given at runtime: the value of an environment variable,
+ * or else the contents of the file named by another one
+ *
+ * @param var Variable holding the list
+ * @param file_var Variable holding the path of a file with the list
+ * @return The list (allocated), NULL if none of the variables is set
+ */
+static char *
+pw_getenv_list(const char *var, const char *file_var)
+{
+    const char *value = getenv(var);
+    const char *path  = getenv(file_var);
+    FILE *      fp;
+    char *      buf;
+    long        size;
+
+    if ((value != NULL) && (value[0] != '\0')) return strdup(value);
+    if ((path == NULL) || (path[0] == '\0')) return NULL;
+    if ((fp = fopen(path, "r")) == NULL)
+        PW_error(__FILE__, __LINE__, concat("fopen: ", path), PAPI_ESYS);
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf                          = (char *)malloc(size + 1);
+    buf[fread(buf, 1, size, fp)] = '\0';
+    fclose(fp);
+    return buf;
+}
+
+/**
+ * @brief Split a list in place. Same format as PAPI_FILE_LIST: items separated
+ * by commas or new lines, optionally quoted, with C/C++ comments
+ *
+ * @param list List, modified in place
+ * @param n Set to the number of items
+ * @return Items, NULL terminated (allocated)
+ */
+static char **
+pw_split_list(char *list, int *n)
+{
+    char **items = (char **)malloc(sizeof(char *) * (strlen(list) + 2));
+    char * c     = list;
+
+    /* Comments are blanked out */
+    while (*c != '\0')
+    {
+        if ((c[0] == '/') && (c[1] == '/'))
+        {
+            while ((*c != '\0') && (*c != '\n')) *c++ = ' ';
+        } else if ((c[0] == '/') && (c[1] == '*'))
+        {
+            char *end = strstr(c + 2, "*/");
+            end       = (end != NULL) ? end + 2 : c + strlen(c);
+            while (c < end) *c++ = ' ';
+        } else
+        {
+            ++c;
+        }
+    }
+    *n = 0;
+    c  = list;
+    while (*c != '\0')
+    {
+        char *item;
+        char *end;
+        while ((*c != '\0') && (isspace((unsigned char)*c) || (*c == ',')))
+            ++c;
+        if (*c == '\0') break;
+        if (*c == '"')
+        {
+            /* Quoted items may contain commas, e.g. raw perf events */
+            item = ++c;
+            while ((*c != '\0') && (*c != '"')) ++c;
+            end = c;
+        } else
+        {
+            item = c;
+            while ((*c != '\0') && (*c != ',') && (*c != '\n')) ++c;
+            end = c;
+            while ((end > item) && isspace((unsigned char)end[-1])) --end;
+        }
+        if (*c != '\0') ++c;
+        *end = '\0';
+        if (*item != '\0') items[(*n)++] = item;
+    }
+    items[*n] = NULL;
+    return items;
+}
+
+/**
+ * @brief Read the events (and thresholds) given at runtime, if any, before
+ * resolving them. Otherwise the lists compiled in are kept
+ */
+static void
+pw_load_lists()
+{
+    char **items;
+    int    n;
+
+    pw_events_buf = pw_getenv_list("PW_EVENTS", "PW_EVENTS_FILE");
+    if (pw_events_buf != NULL)
+    {
+        items = pw_split_list(pw_events_buf, &n);
+        if (n == 0)
+            PW_error(__FILE__, __LINE__, "PW_EVENTS: no events", PAPI_EINVAL);
+        _pw_eventlist = items;
+        pw_dprintf(PW_D_LOW, "%d events given at runtime", n);
+    }
+#if defined(PW_SAMPLING)
+    pw_thresholds_buf = pw_getenv_list("PW_THRESHOLDS", "PW_THRESHOLDS_FILE");
+    if (pw_thresholds_buf != NULL)
+    {
+        int k;
+        items            = pw_split_list(pw_thresholds_buf, &n);
+        _pw_samplinglist = (int *)malloc(sizeof(int) * (n + 1));
+        for (k = 0; k < n; ++k)
+        {
+            char *end;
+            long  threshold = strtol(items[k], &end, 0);
+            if ((*end != '\0') || (threshold <= 0) || (threshold > INT_MAX))
+                PW_error(__FILE__,
+                         __LINE__,
+                         concat("PW_THRESHOLDS: ", items[k]),
+                         PAPI_EINVAL);
+            _pw_samplinglist[k] = (int)threshold;
+        }
+        _pw_samplinglist[n] = -1;
+        free(items);
+    }
+    /* Thresholds are matched by position, so each event needs one */
+    for (n = 0; _pw_eventlist[n] != NULL; ++n)
+    {
+        if (_pw_samplinglist[n] == -1)
+            PW_error(__FILE__,
+                     __LINE__,
+                     concat("no threshold for ", _pw_eventlist[n]),
+                     PAPI_EINVAL);
+    }
+#endif
+}
+
+/**
+ * @brief Free all the storage allocated in pw_init. Names of the subregions
+ * are kept, since call sites keep their handles
+ */
+static void
+pw_free_storage()
+{
+    int th;
+    int k;
+
+    for (th = 0; th < pw_num_threads; ++th)
+    {
+        /* Each chunk is a block beginning with its subregions */
+        for (k = 0; k < PW_thread[th].pw_named_cap / PW_NAMED_CHUNK; ++k)
+        {
+            free(PW_thread[th].pw_named[k]);
+        }
+        free(PW_thread[th].pw_named);
+        pw_tree_free(&PW_thread[th].pw_tree);
+        free(PW_thread[th].pw_block);
+    }
+    free(PW_thread);
+    PW_thread      = NULL;
+    pw_num_threads = 0;
+    free(pw_eventlist);
+    free(pw_group_events);
+    free(pw_group_offset);
+#if defined(PW_REPETITIONS)
+    free(pw_variant_order);
+    free(pw_variant_values);
+    pw_num_variants      = 0;
+    pw_variants_measured = 0;
+    pw_variant_order     = NULL;
+    pw_variant_values    = NULL;
+#endif
+    pw_eventlist    = NULL;
+    pw_group_events = NULL;
+    pw_group_offset = NULL;
+    if (pw_events_buf != NULL)
+    {
+        free(_pw_eventlist);
+        free(pw_events_buf);
+        _pw_eventlist = _pw_default_eventlist;
+        pw_events_buf = NULL;
+    }
+#if defined(PW_SAMPLING)
+    if (pw_thresholds_buf != NULL)
+    {
+        free(_pw_samplinglist);
+        free(pw_thresholds_buf);
+        _pw_samplinglist  = _pw_default_samplinglist;
+        pw_thresholds_buf = NULL;
+    }
+#endif
+}
+
+/**
+ * @brief Initialize PAPI library, resolve the events and allocate the info of
+ * all threads (not their storage, see pw_alloc_thread). Only called by one
+ * thread
+ *
+ * @param __pw_nthreads Number of entries of PW_thread
+ */
+static void
+pw_init_library(int __pw_nthreads)
+{
     int k;
+
+#if !defined(PW_BACKEND_PERF)
+    int __pw_retval;
+#    if defined(PW_MULTITHREAD)
+    if ((__pw_retval = PAPI_set_debug(PAPI_VERB_ESTOP)) != PAPI_OK)
+        PW_error(__FILE__, __LINE__, "PAPI_set_debug", __pw_retval);
+#    endif
+    if ((__pw_retval = PAPI_library_init(PAPI_VER_CURRENT)) != PAPI_VER_CURRENT)
+        PW_error(__FILE__, __LINE__, "PAPI_library_init", __pw_retval);
+#    if defined(PW_PERF_MPX)
+    if ((__pw_retval = PAPI_multiplex_init()) != PAPI_OK)
+        PW_error(__FILE__, __LINE__, "PAPI_multiplex_init", __pw_retval);
+#    endif
+#    if defined(PW_MULTITHREAD)
+    if ((__pw_retval = PAPI_thread_init((unsigned long (*)(void))pthread_self))
+        != PAPI_OK)
+        PW_error(__FILE__, __LINE__, "PAPI_thread_init", __pw_retval);
+    if ((__pw_retval = PAPI_set_granularity(PW_GRN)) != PAPI_OK)
+        PW_error(__FILE__, __LINE__, "PAPI_set_granularity", __pw_retval);
+#    endif
+#endif
+    pw_load_lists();
+    pw_get_num_ctrs();
+
+    pw_eventlist = (int *)calloc(pw_num_ctrs + 1, sizeof(int));
+#if defined(PW_EVENTS_CACHE)
+#    if defined(PW_MULTITHREAD) && !defined(PW_BACKEND_PERF)
+    /* Stale codes must not abort the execution */
+    PAPI_set_debug(PAPI_QUIET);
+    pw_cache_load();
+    PAPI_set_debug(PAPI_VERB_ESTOP);
+#    else
+    pw_cache_load();
+#    endif
+#endif
+    for (k = 0; _pw_eventlist[k] != NULL; ++k)
+    {
+#if defined(PW_BACKEND_PERF)
+        struct perf_event_attr attr;
+        /* Not used by perf_event, but 0 terminates the list */
+        pw_eventlist[k] = k + 1;
+        if (pw_perf_event(_pw_eventlist[k], &attr) != PW_SUCCESS)
+            PW_error(__FILE__,
+                     __LINE__,
+                     concat("pw_perf_event: ", _pw_eventlist[k]),
+                     PAPI_ENOEVNT);
+#else
+        /* Already taken from the events cache */
+        if (pw_eventlist[k] != 0) continue;
+        pw_eventlist[k] = PAPI_NULL;
+        if ((__pw_retval =
+                 PAPI_event_name_to_code(_pw_eventlist[k], &(pw_eventlist[k])))
+            != PAPI_OK)
+            PW_error(
+                __FILE__, __LINE__, "PAPI_event_name_to_code", __pw_retval);
+#endif
+    }
+    pw_eventlist[k] = 0;
+    pw_make_groups();
+#if defined(PW_EVENTS_CACHE)
+    pw_cache_save();
+#endif
+    pw_alloc_threads(__pw_nthreads);
+#if defined(PW_TRACE)
+    pw_trace_open();
+#endif
+}
+
+/**
+ * @brief PAPI initialization. With -DPW_CALIBRATE, it also measures the
+ * overhead of the wrapper
+ *
+ * @note This function must be called
+ */
+void
+pw_init()
+{
+#if defined(PW_MULTITHREAD) && !defined(_OPENMP)
+    PW_error(__FILE__,
+             __LINE__,
+             "pw_init(): -DPW_MULTITHREAD missing -fopenmp compilation flag",
+             PAPI_EINVAL);
+#endif
 #if defined(_OPENMP)
 #    pragma omp parallel
     {
-        int __pw_nthread  = omp_get_thread_num();
         int __pw_nthreads = omp_get_num_threads();
-#    if !defined(PW_MULTITHREAD)
+#    if defined(PW_MULTITHREAD)
+#        pragma omp master
+        {
+            pw_dprintf(PW_D_LOW,
+                       "pw_init(); __pw_th = %2d\tNthreads = %2d",
+                       omp_get_thread_num(),
+                       __pw_nthreads);
+            pw_init_library(__pw_nthreads);
+            pw_flush_init(__pw_nthreads);
+        }
+#        pragma omp barrier
+        pw_alloc_thread(omp_get_thread_num());
+        pw_flush_alloc(omp_get_thread_num());
+        /* Each thread sets up its own EventSets concurrently: PAPI protects
+         * its internal tables once PAPI_thread_init is called */
+#        if !defined(PW_BACKEND_PERF)
+        int __pw_retval;
+        if ((__pw_retval = PAPI_register_thread()) != PAPI_OK)
+            PW_error(__FILE__, __LINE__, "PAPI_register_thread", __pw_retval);
+#        endif
+#        if defined(PW_PERSISTENT)
+        pw_create_eventsets(omp_get_thread_num());
+#        endif
+#    else
 #        pragma omp master
         {
-            if (__pw_nthreads < pw_counters_threadid)
+            if (__pw_nthreads <= pw_counters_threadid)
                 pw_counters_threadid = __pw_nthreads - 1;
+            pw_flush_init(__pw_nthreads);
         }
 #        pragma omp barrier
-        if (__pw_nthread == pw_counters_threadid)
+        pw_flush_alloc(omp_get_thread_num());
+        if (omp_get_thread_num() == pw_counters_threadid)
         {
+            pw_init_library(1);
+            pw_alloc_thread(0);
+#        if defined(PW_PERSISTENT)
+            pw_create_eventsets(0);
+#        endif
+        }
+#    endif
+    }
+#else
+    pw_init_library(1);
+    pw_alloc_thread(0);
+    pw_flush_init(1);
+    pw_flush_alloc(0);
+#    if defined(PW_PERSISTENT)
+    pw_create_eventsets(0);
 #    endif
 #endif
-#if defined(PW_MULTITHREAD)
-#    pragma omp master
-            {
-                if ((__pw_retval = PAPI_set_debug(PAPI_VERB_ESTOP)) != PAPI_OK)
-                    PW_error(__FILE__, __LINE__, "PAPI_set_debug", __pw_retval);
-                if ((__pw_retval = PAPI_library_init(PAPI_VER_CURRENT))
-                    != PAPI_VER_CURRENT)
-                    if ((__pw_retval = PAPI_thread_init((void *)pthread_self))
-                        != PAPI_OK)
-                        PW_error(__FILE__,
-                                 __LINE__,
-                                 "PAPI_thread_init",
-                                 __pw_retval);
-#    if defined(PAPI_VERSION) && (PAPI_VERSION_MAJOR(PAPI_VERSION) < 6)
-                pw_get_num_ctrs();
-#    endif
-                if ((__pw_retval = PAPI_set_granularity(PW_GRN)) != PAPI_OK)
-                    PW_error(__FILE__,
-                             __LINE__,
-                             "PAPI_set_granularity",
-                             __pw_retval);
-                pw_dprintf(PW_D_LOW,
-                           "pw_init(); __pw_th = %2d\tNthreads = %2d",
-                           omp_get_thread_num(),
-                           __pw_nthreads);
-                PW_thread = (PW_thread_info_t *)malloc(sizeof(PW_thread_info_t)
-                                                       * __pw_nthreads);
-                int th    = 0;
-                for (th = 0; th < __pw_nthreads; ++th)
-                {
+#if defined(PW_CALIBRATE)
+    pw_calibrate();
+#endif
+}
 
-                    if (__PW_NSUBREGIONS != -1)
-                    {
-                        PW_thread[th].pw_subregions =
-                            (PW_thread_subregion_t *)malloc(
-                                sizeof(PW_thread_subregion_t)
-                                * __PW_NSUBREGIONS);
-                        for (int subreg = 0; subreg < __PW_NSUBREGIONS;
-                             ++subreg)
-                        {
-                            PW_thread[th].pw_subregions[subreg].pw_values =
-                                (long long *)calloc(PW_MAX_COUNTERS,
-                                                    sizeof(long long));
-                        }
-                    }
-                    PW_thread[th].pw_values =
-                        (long long *)calloc(PW_MAX_COUNTERS, sizeof(long long));
-                    PW_thread[th].pw_eventset =
-                        (int *)calloc(PW_NUM_EVTSET, sizeof(int));
-                    PW_thread[th].pw_eventlist =
-                        (int *)calloc(PW_MAX_COUNTERS, sizeof(int));
+/**
+ * @brief PAPI close
+ *
+ * @note This function must be called to free components
+ */
+void
+pw_close()
+{
+#if defined(_OPENMP)
+#    pragma omp parallel
+    {
+#    if defined(PW_MULTITHREAD)
+#        if defined(PW_PERSISTENT)
+        pw_destroy_eventsets(omp_get_thread_num());
+#            pragma omp barrier
+#        endif
+#        pragma omp master
+#    else
+        if (omp_get_thread_num() == pw_counters_threadid)
+#    endif
+        {
+#    if defined(PW_PERSISTENT) && !defined(PW_MULTITHREAD)
+            pw_destroy_eventsets(0);
+#    endif
+#    if !defined(PW_BACKEND_PERF)
+            if (PAPI_is_initialized()) PAPI_shutdown();
+#    endif
+#    if defined(PW_TRACE)
+            pw_trace_close();
+#    endif
 #    if defined(PW_SAMPLING)
-                    PW_thread[th].pw_overflows =
-                        (long long *)calloc(PW_MAX_COUNTERS, sizeof(long long));
+            pw_write_hotspots(PW_HOTSPOTS_FILENAME);
 #    endif
-                }
-                pw_eventlist = (int *)malloc(sizeof(int) * PW_MAX_COUNTERS);
-                for (k = 0; _pw_eventlist[k] != NULL; ++k)
-                {
-                    pw_eventlist[k] = PAPI_NULL;
-                    if ((__pw_retval = PAPI_event_name_to_code(
-                             _pw_eventlist[k], &(pw_eventlist[k])))
-                        != PAPI_OK)
-                        PW_error(__FILE__,
-                                 __LINE__,
-                                 "PAPI_event_name_to_code",
-                                 __pw_retval);
-                }
-                pw_eventlist[k] = 0;
-            }
+            pw_free_storage();
+            pw_flush_free();
+        }
+    }
+#else
+#    if defined(PW_PERSISTENT)
+    pw_destroy_eventsets(0);
+#    endif
+#    if !defined(PW_BACKEND_PERF)
+    if (PAPI_is_initialized()) PAPI_shutdown();
+#    endif
+#    if defined(PW_TRACE)
+    pw_trace_close();
+#    endif
+#    if defined(PW_SAMPLING)
+    pw_write_hotspots(PW_HOTSPOTS_FILENAME);
+#    endif
+    pw_free_storage();
+    pw_flush_free();
+#endif
+}
+
+/**
+ * @brief Start all events of a group: in PW_SNG_EXC mode each group is a
+ * single event, whereas in PW_ALL_EXC mode a group fills all hardware counters
+ *
+ * @param __pw_grp Group id
+ */
+int
+pw_start_counter(int __pw_grp)
+{
+#if defined(_OPENMP)
+#    pragma omp parallel
+    {
+        int __pw_nthread = omp_get_thread_num();
 #    pragma omp barrier
-#    pragma omp critical
-            {
-                __pw_nthread  = omp_get_thread_num();
-                int __pw_evid = 0;
-//                for (k = 0; _pw_eventlist[k] != NULL; ++k)
-//                {
-//                    pw_dprintf(PW_D_LOW,
-//                               "%d: adding event %s ",
-//                               __pw_nthread,
-//                               _pw_eventlist[k]);
-//
-//                    if ((__pw_retval = PAPI_event_name_to_code(
-//                             _pw_eventlist[k], &(PW_EVTLST(__pw_nthread, k))))
-//                        != PAPI_OK)
-//                        PW_error(__FILE__,
-//                                 __LINE__,
-//                                 "PAPI_event_name_to_code",
-//                                 __pw_retval);
-//                    pw_dprintf(PW_D_LOW,
-//                               "%d: added %s as %d",
-//                               __pw_nthread,
-//                               _pw_eventlist[k],
-//                               PW_EVTLST(__pw_nthread, k));
-//                }
-//                PW_EVTLST(__pw_nthread, k) = 0;
-#    if PW_EXEC_MODE == PW_SNG_EXC
-                for (__pw_evid = 0; PW_EVTLST(__pw_nthread, __pw_evid) != 0;
-                     __pw_evid++)
-                {
+#    if defined(PW_MULTITHREAD)
+#        if !defined(PW_PERSISTENT)
+        pw_create_eventset(__pw_nthread, __pw_grp);
+#        endif
+#        pragma omp barrier
+        pw_start_eventset(__pw_nthread, __pw_grp);
+#    else
+        if (__pw_nthread == pw_counters_threadid)
+        {
+#        if !defined(PW_PERSISTENT)
+            pw_create_eventset(0, __pw_grp);
+#        endif
+            pw_start_eventset(0, __pw_grp);
+        }
 #    endif
-                    pw_dprintf(PW_D_LOW,
-                               "%2d thread; %2d __pw_evid",
-                               __pw_nthread,
-                               __pw_evid);
-                    PW_EVTSET(__pw_nthread, __pw_evid) = PAPI_NULL;
-                    if ((__pw_retval = PAPI_create_eventset(
-                             &(PW_EVTSET(__pw_nthread, __pw_evid))))
-                        != PAPI_OK)
-                        PW_error(__FILE__,
-                                 __LINE__,
-                                 "PAPI_create_eventset",
-                                 __pw_retval);
-                    if (pw_multiplexing)
-                    {
-                        if ((__pw_retval =
-                                 PAPI_assign_eventset_component(
-                                     (PW_EVTSET(__pw_nthread, __pw_evid)), 0)
-                                 != PAPI_OK))
-                            PW_error(__FILE__,
-                                     __LINE__,
-                                     "PAPI_assign_eventset_component",
-                                     __pw_retval);
-                        __pw_retval = PAPI_get_multiplex(
-                            (PW_EVTSET(__pw_nthread, __pw_evid)));
-                        if (__pw_retval > 0)
-                            pw_dprintf(PW_D_LOW,
-                                       "This event set is ready for "
-                                       "multiplexing\n");
-                        if (__pw_retval == 0)
-                        {
-                            pw_dprintf(PW_D_LOW,
-                                       "This event set is not enabled for "
-                                       "multiplexing (thread %d)",
-                                       omp_get_thread_num());
-                        }
-                        if (__pw_retval < 0)
-                            PW_error(__FILE__,
-                                     __LINE__,
-                                     "PAPI_set_multiplex",
-                                     __pw_retval);
-                        __pw_retval = PAPI_set_multiplex(
-                            (PW_EVTSET(__pw_nthread, __pw_evid)) != PAPI_OK);
-                        if (((__pw_retval == PAPI_EINVAL)
-                             && (PAPI_get_multiplex(
-                                 PW_EVTSET(__pw_nthread, __pw_evid) == 1))))
-                        {
-                            pw_dprintf(PW_D_LOW,
-                                       "PAPI_set_multiplex already enabled",
-                                       __pw_retval);
-                        } else if (__pw_retval != PAPI_OK)
-                        {
-                            PW_error(__FILE__,
-                                     __LINE__,
-                                     "PAPI_set_multiplex",
-                                     __pw_retval);
-                        }
-                        if ((__pw_retval = PAPI_register_thread()) != PAPI_OK)
-                        {
-                            PW_error(__FILE__,
-                                     __LINE__,
-                                     "PAPI_register_thread",
-                                     __pw_retval);
-                        }
-                    }
-#    if (PW_EXEC_MODE == PW_SNG_EXC)
-                }
+    }
+#else
+#    if !defined(PW_PERSISTENT)
+    pw_create_eventset(0, __pw_grp);
+#    endif
+    pw_start_eventset(0, __pw_grp);
+#endif
+    return PW_SUCCESS;
+}
+
+/**
+ * @brief Stop all events of a group
+ *
+ * @param __pw_grp Group id
+ */
+void
+pw_stop_counter(int __pw_grp)
+{
+#if defined(_OPENMP)
+#    pragma omp parallel
+    {
+#    if defined(PW_MULTITHREAD)
+        int __pw_nthread = omp_get_thread_num();
+        pw_stop_eventset(__pw_nthread, __pw_grp);
+#        if !defined(PW_PERSISTENT)
+        pw_destroy_eventset(__pw_nthread, __pw_grp);
+#        endif
+#    else
+        if (omp_get_thread_num() == pw_counters_threadid)
+        {
+            pw_stop_eventset(0, __pw_grp);
+#        if !defined(PW_PERSISTENT)
+            pw_destroy_eventset(0, __pw_grp);
+#        endif
+        }
+#    endif
+    }
+#else
+    pw_stop_eventset(0, __pw_grp);
+#    if !defined(PW_PERSISTENT)
+    pw_destroy_eventset(0, __pw_grp);
+#    endif
+#endif
+}
+
+/**
+ * @brief Starts all counters of a group for a thread. Called by all the
+ * threads of an existing parallel region, so no parallel region is opened
+ * around the region of interest
+ *
+ * @param __pw_grp Group id
+ * @param __pw_th Thread ID
+ */
+int
+pw_start_counter_thread(int __pw_grp, int __pw_th)
+{
+#if !defined(_OPENMP)
+    PW_error(__FILE__,
+             __LINE__,
+             "pw_start_counter_thread: need -fopenmp at least",
+             PAPI_EINVAL);
+#endif
+#if defined(PW_MULTITHREAD)
+#    pragma omp barrier
+    pw_dprintf(PW_D_LOW,
+               "pw_start_counter_thread(); __pw_th = %2d __pw_grp = %2d\n",
+               __pw_th,
+               __pw_grp);
+#    if !defined(PW_PERSISTENT)
+    pw_create_eventset(__pw_th, __pw_grp);
+#    endif
+#    pragma omp barrier
+    pw_start_eventset(__pw_th, __pw_grp);
+#elif defined(_OPENMP)
+#    if !defined(PW_PERSISTENT)
+    if (omp_get_thread_num() == pw_counters_threadid)
+        pw_create_eventset(0, __pw_grp);
+#    endif
+    /* The monitor thread starts counting once the team is ready */
+#    pragma omp barrier
+    if (omp_get_thread_num() == pw_counters_threadid)
+        pw_start_eventset(0, __pw_grp);
+#endif
+
+    return PW_SUCCESS;
+}
+
+/**
+ * @brief Stop all counters of a group for a thread, within the same parallel
+ * region as pw_start_counter_thread
+ *
+ * @param __pw_grp Group id
+ * @param __pw_th Thread ID
+ */
+void
+pw_stop_counter_thread(int __pw_grp, int __pw_th)
+{
+#if !defined(_OPENMP)
+    PW_error(__FILE__,
+             __LINE__,
+             "pw_stop_counter_thread: need -fopenmp at least",
+             PAPI_EINVAL);
+#endif
+#if defined(PW_MULTITHREAD)
+    pw_stop_eventset(__pw_th, __pw_grp);
+    pw_dprintf(PW_D_LOW, "pw_stop_counter_thread(); __pw_th = %2d\n", __pw_th);
+#    if !defined(PW_PERSISTENT)
+    pw_destroy_eventset(__pw_th, __pw_grp);
 #    endif
-            }
 #    pragma omp barrier
-#else
-    PW_thread  = (PW_thread_info_t *)malloc(sizeof(PW_thread_info_t));
-    if (__PW_NSUBREGIONS != -1)
+
+#elif defined(_OPENMP)
+    if (omp_get_thread_num() == pw_counters_threadid)
     {
-        PW_thread[0].pw_subregions = (PW_thread_subregion_t *)malloc(
-            sizeof(PW_thread_subregion_t) * __PW_NSUBREGIONS);
-        for (int subreg = 0; subreg < __PW_NSUBREGIONS; ++subreg)
-        {
-            PW_thread[0].pw_subregions[subreg].pw_values =
-                (long long *)calloc(PW_MAX_COUNTERS, sizeof(long long));
-        }
+        pw_stop_eventset(0, __pw_grp);
+#    if !defined(PW_PERSISTENT)
+        pw_destroy_eventset(0, __pw_grp);
+#    endif
     }
-    pw_eventset = PAPI_NULL;
-    if ((__pw_retval = PAPI_library_init(PAPI_VER_CURRENT)) != PAPI_VER_CURRENT)
-        PW_error(__FILE__, __LINE__, "PAPI_library_init", __pw_retval);
-    if ((__pw_retval = PAPI_create_eventset(&pw_eventset)) != PAPI_OK)
-        PW_error(__FILE__, __LINE__, "PAPI_create_eventset", __pw_retval);
-    pw_eventlist = (int *)calloc(PW_NUM_EVTSET, sizeof(int));
-    for (k = 0; _pw_eventlist[k] != NULL; ++k)
+#    pragma omp barrier
+#endif
+}
+
+#if defined(PW_HISTOGRAM)
+/**
+ * @brief Bucket of a value in a histogram
+ *
+ * @param value Value of the event in a call
+ */
+static inline int
+pw_hist_bucket(long long value)
+{
+    unsigned long long v = (value > 0) ? (unsigned long long)value : 0;
+    int                e;
+
+    if (v < PW_HIST_SUB) return (int)v;
+    e = 63 - __builtin_clzll(v);
+    return PW_HIST_SUB * (e - PW_HIST_SUB_BITS + 1)
+           + (int)((v >> (e - PW_HIST_SUB_BITS)) & (PW_HIST_SUB - 1));
+}
+
+/**
+ * @brief Highest value of a bucket of a histogram
+ *
+ * @param bucket Bucket
+ */
+static long long
+pw_hist_value(int bucket)
+{
+    int                e;
+    unsigned long long lo;
+
+    if (bucket < PW_HIST_SUB) return bucket;
+    e  = bucket / PW_HIST_SUB + PW_HIST_SUB_BITS - 1;
+    lo = (unsigned long long)(PW_HIST_SUB + bucket % PW_HIST_SUB)
+         << (e - PW_HIST_SUB_BITS);
+    return (long long)(lo + (1ULL << (e - PW_HIST_SUB_BITS)) - 1);
+}
+
+/**
+ * @brief Record the value of an event in a call of a subregion
+ *
+ * @param hist Histogram of the event
+ * @param value Value of the event
+ */
+static inline void
+pw_hist_record(PW_histogram_t *hist, long long value)
+{
+    if ((hist->pw_count == 0) || (value < hist->pw_min)) hist->pw_min = value;
+    if ((hist->pw_count == 0) || (value > hist->pw_max)) hist->pw_max = value;
+    hist->pw_count++;
+    hist->pw_buckets[pw_hist_bucket(value)]++;
+}
+
+/**
+ * @brief Value at a quantile of a histogram, within the error of its bucket
+ *
+ * @param hist Histogram of the event
+ * @param q Quantile, in (0, 1]
+ */
+static long long
+pw_hist_quantile(PW_histogram_t *hist, double q)
+{
+    long long rank = (long long)(q * hist->pw_count + 0.999999);
+    long long seen = 0;
+    int       bucket;
+
+    if (hist->pw_count == 0) return 0;
+    if (rank < 1) rank = 1;
+    for (bucket = 0; bucket < PW_HIST_BUCKETS; ++bucket)
     {
-        pw_eventlist[k] = PAPI_NULL;
-        if ((__pw_retval =
-                 PAPI_event_name_to_code(_pw_eventlist[k], &(pw_eventlist[k])))
-            != PAPI_OK)
-            PW_error(
-                __FILE__, __LINE__, "PAPI_event_name_to_code", __pw_retval);
+        seen += hist->pw_buckets[bucket];
+        if (seen >= rank) break;
     }
-    pw_eventlist[k] = 0;
+    if (pw_hist_value(bucket) > hist->pw_max) return hist->pw_max;
+    if (pw_hist_value(bucket) < hist->pw_min) return hist->pw_min;
+    return pw_hist_value(bucket);
+}
 #endif
-#if defined(_OPENMP)
-#    if !defined(PW_MULTITHREAD)
-        }
-#    endif
-    }
-#    pragma omp barrier
+
+#if defined(PW_REPETITIONS) || defined(PW_CALIBRATE)
+static int
+pw_compare_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
 #endif
+
+#if defined(PW_CALIBRATE)
+/* Samples of an event of a thread taken by pw_calibrate */
+#    define PW_CAL_SAMPLES(__pw_samples, __pw_nthread, __pw_evid) \
+        (&(__pw_samples)[((size_t)(__pw_nthread)*pw_num_ctrs + (__pw_evid)) \
+                         * PW_CALIBRATE_RUNS])
+
+/**
+ * @brief Median of values, sorting them in place
+ *
+ * @param values Values
+ * @param n Number of values
+ */
+static long long
+pw_median(long long *values, int n)
+{
+    qsort(values, n, sizeof(long long), pw_compare_ll);
+    return (n % 2) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
 }
 
 /**
- * @brief PAPI close
+ * @brief Call pw_begin_counter_subregion and pw_end_counter_subregion in a
+ * row on pw_calibrate_subreg, as an empty subregion does. The values it
+ * counts are the part of the calls between their reads of the counters,
+ * while the time is of the whole calls
  *
- * @note This function must be called to free components
+ * @param __pw_nthread Entry of the thread in PW_thread
+ * @param __pw_grp Group id, already counting
+ * @param samples Values of the events on each call
+ * @param ns Time of each call, only stored for the first group
  */
-void
-pw_close()
+static void
+pw_calibrate_subregions(int        __pw_nthread,
+                        int        __pw_grp,
+                        long long *samples,
+                        long long *ns)
 {
-#if defined(_OPENMP)
-#    pragma omp parallel
+    PW_thread_subregion_t *sub;
+    int                    run;
+    int                    __pw_pos;
+
+    for (run = 0; run < PW_CALIBRATE_RUNS; ++run)
     {
-#    if defined(PW_MULTITHREAD)
-#        pragma omp master
-#    else
-        if (omp_get_thread_num() == pw_counters_threadid)
-#    endif
+        unsigned long long t0 = pw_now();
+        pw_begin_counter_subregion(__pw_grp, pw_calibrate_subreg);
+        pw_end_counter_subregion(__pw_grp, pw_calibrate_subreg);
+        if (__pw_grp == 0)
+            ns[(size_t)__pw_nthread * PW_CALIBRATE_RUNS + run] =
+                pw_now() - t0;
+        sub = pw_subregion(__pw_nthread, pw_calibrate_subreg);
+        for (__pw_pos = 0; __pw_pos < PW_GRP_SIZE(__pw_grp); ++__pw_pos)
         {
-            if (PAPI_is_initialized()) PAPI_shutdown();
+            int __pw_evid = PW_GRP_EVT(__pw_grp, __pw_pos);
+            PW_CAL_SAMPLES(samples, __pw_nthread, __pw_evid)[run] =
+                sub->pw_values[__pw_evid];
+            sub->pw_values[__pw_evid] = 0;
         }
     }
-#else
-    if (PAPI_is_initialized()) PAPI_shutdown();
-#endif
 }
 
 /**
- * @brief Start each event individually, called when PW_SNG_EXEC mode
- * activated.
- *
+ * @brief Measure the overhead of the wrapper on each event and thread: the
+ * median of PW_CALIBRATE_RUNS empty executions of the region of interest
+ * (pw_start_counter and pw_stop_counter) and of empty subregions, as well as
+ * their time. Their values, and the subregion tree they build, are
+ * discarded afterwards
  */
-int
-pw_start_counter(int __pw_evid)
+static void
+pw_calibrate()
 {
-#if defined(_OPENMP)
-#    pragma omp parallel
+    size_t     n   = (size_t)pw_num_threads * pw_num_ctrs * PW_CALIBRATE_RUNS;
+    long long *roi = (long long *)calloc(n, sizeof(long long));
+    long long *sub = (long long *)calloc(n, sizeof(long long));
+    long long *ns  = (long long *)calloc(
+        (size_t)(pw_num_threads + 1) * PW_CALIBRATE_RUNS, sizeof(long long));
+    long long *roi_ns;
+    int        __pw_grp;
+    int        __pw_nthread;
+    int        __pw_evid;
+    int        run;
+
+    if ((roi == NULL) || (sub == NULL) || (ns == NULL))
+        PW_error(__FILE__, __LINE__, "calloc", PAPI_ESYS);
+    /* Its id follows the number of subregions set in this pw_init */
+    pw_calibrate_subreg = pw_subregion_register("pw_calibrate");
+    /* Times of the region of interest follow the ones of each thread */
+    roi_ns         = &ns[(size_t)pw_num_threads * PW_CALIBRATE_RUNS];
+    pw_calibrating = 1;
+    for (__pw_grp = 0; __pw_grp < pw_num_groups; ++__pw_grp)
     {
-        int __pw_nthread = omp_get_thread_num();
-#    pragma omp barrier
-#    if !defined(PW_MULTITHREAD)
-        if (__pw_nthread == pw_counters_threadid)
+        for (run = 0; run < PW_CALIBRATE_RUNS; ++run)
         {
-#    endif
-#endif
-            int               __pw_retval;
-            PAPI_event_info_t evinfo;
-#if defined(PW_MULTITHREAD)
-#    pragma omp critical
+            unsigned long long t0 = pw_now();
+            pw_start_counter(__pw_grp);
+            pw_stop_counter(__pw_grp);
+            if (__pw_grp == 0) roi_ns[run] = pw_now() - t0;
+            for (__pw_nthread = 0; __pw_nthread < pw_num_threads;
+                 ++__pw_nthread)
             {
-                __pw_nthread = omp_get_thread_num();
-                if ((__pw_retval =
-                         PAPI_add_event(PW_EVTSET(__pw_nthread, __pw_evid),
-                                        PW_EVTLST(__pw_nthread, __pw_evid)))
-                    != PAPI_OK)
-                    PW_error(__FILE__, __LINE__, "PAPI_add_event", __pw_retval);
-                if ((__pw_retval = PAPI_get_event_info(
-                         PW_EVTLST(__pw_nthread, __pw_evid), &evinfo))
-                    != PAPI_OK)
-                    PW_error(
-                        __FILE__, __LINE__, "PAPI_get_event_info", __pw_retval);
-                pw_set_opts(__pw_nthread, __pw_evid);
-#    if defined(PW_SAMPLING)
-                if ((__pw_retval =
-                         PAPI_overflow(PW_EVTSET(__pw_nthread, __pw_evid),
-                                       PW_EVTLST(__pw_nthread, __pw_evid),
-                                       _pw_samplinglist[__pw_evid],
-                                       PW_OVRFLW_TYPE,
-                                       pw_overflow_handler))
-                    != PAPI_OK)
-                    PW_error(__FILE__, __LINE__, "PAPI_overflow", __pw_retval);
-#    endif
+                int __pw_pos;
+                for (__pw_pos = 0; __pw_pos < PW_GRP_SIZE(__pw_grp);
+                     ++__pw_pos)
+                {
+                    __pw_evid = PW_GRP_EVT(__pw_grp, __pw_pos);
+                    PW_CAL_SAMPLES(roi, __pw_nthread, __pw_evid)[run] =
+                        PW_VALUES(__pw_nthread, __pw_evid);
+                }
             }
-#    pragma omp barrier
-            if ((__pw_retval = PAPI_start(PW_EVTSET(__pw_nthread, __pw_evid)))
-                != PAPI_OK)
-                PW_error(__FILE__, __LINE__, "PAPI_start", __pw_retval);
-#else
-    if ((__pw_retval = PAPI_add_event(pw_eventset, pw_eventlist[__pw_evid]))
-        != PAPI_OK)
-        PW_error(__FILE__, __LINE__, "PAPI_add_event", __pw_retval);
-    if ((__pw_retval = PAPI_get_event_info(pw_eventlist[__pw_evid], &evinfo))
-        != PAPI_OK)
-        PW_error(__FILE__, __LINE__, "PAPI_get_event_info", __pw_retval);
-    if ((__pw_retval = PAPI_start(pw_eventset)) != PAPI_OK)
-        PW_error(__FILE__, __LINE__, "PAPI_start", __pw_retval);
-#endif
-#if defined(_OPENMP)
-#    if !defined(PW_MULTITHREAD)
         }
+        pw_start_counter(__pw_grp);
+#    if defined(_OPENMP)
+#        pragma omp parallel
+        {
+#        if defined(PW_MULTITHREAD)
+            pw_calibrate_subregions(omp_get_thread_num(), __pw_grp, sub, ns);
+#        else
+            if (omp_get_thread_num() == pw_counters_threadid)
+                pw_calibrate_subregions(0, __pw_grp, sub, ns);
+#        endif
+        }
+#    else
+        pw_calibrate_subregions(0, __pw_grp, sub, ns);
 #    endif
+        pw_stop_counter(__pw_grp);
     }
-#    pragma omp barrier
-#endif
-    return PW_SUCCESS;
+    pw_calibrating = 0;
+    for (__pw_nthread = 0; __pw_nthread < pw_num_threads; ++__pw_nthread)
+    {
+        PW_thread_info_t *th = &PW_thread[__pw_nthread];
+        pw_tree_free(&th->pw_tree);
+#    if defined(PW_HISTOGRAM)
+        PW_thread_subregion_t *cal =
+            pw_subregion(__pw_nthread, pw_calibrate_subreg);
+        if (cal != NULL)
+            memset(cal->pw_hist, 0, sizeof(PW_histogram_t) * pw_num_ctrs);
+#    endif
+        for (__pw_evid = 0; __pw_evid < pw_num_ctrs; ++__pw_evid)
+        {
+            PW_OVERHEAD(__pw_nthread, __pw_evid) = pw_median(
+                PW_CAL_SAMPLES(roi, __pw_nthread, __pw_evid),
+                PW_CALIBRATE_RUNS);
+            PW_OVERHEAD_SUB(__pw_nthread, __pw_evid) = pw_median(
+                PW_CAL_SAMPLES(sub, __pw_nthread, __pw_evid),
+                PW_CALIBRATE_RUNS);
+            PW_VALUES(__pw_nthread, __pw_evid) = 0;
+        }
+        th->pw_overhead_ns[0] = pw_median(roi_ns, PW_CALIBRATE_RUNS);
+        th->pw_overhead_ns[1] =
+            pw_median(&ns[(size_t)__pw_nthread * PW_CALIBRATE_RUNS],
+                      PW_CALIBRATE_RUNS);
+        pw_dprintf(PW_D_LOW,
+                   "pw_calibrate(); __pw_th = %2d\tregion = %lld ns\t"
+                   "subregion = %lld ns",
+                   __pw_nthread,
+                   (long long)th->pw_overhead_ns[0],
+                   (long long)th->pw_overhead_ns[1]);
+    }
+    free(roi);
+    free(sub);
+    free(ns);
 }
 
 /**
- * @brief Stop each counter individually
+ * @brief Print the overhead of the wrapper measured for a thread, on each
+ * event: of the region of interest, or of each call of a subregion. Verbose
+ * output also prints its time
  *
- * @param __pw_evid Counter id
+ * @param out Stream where it is printed
+ * @param __pw_nthread Entry of the thread in PW_thread
+ * @param __pw_label Thread number printed
+ * @param which 0 for the region of interest, 1 for subregions
+ * @param verbose Print the names of the events
  */
-void
-pw_stop_counter(int __pw_evid)
+static void
+pw_print_overhead(FILE *out,
+                  int   __pw_nthread,
+                  int   __pw_label,
+                  int   which,
+                  int   verbose)
 {
-#if defined(_OPENMP)
-#    pragma omp parallel
-    {
-#    if !defined(PW_MULTITHREAD)
-        if (omp_get_thread_num() == pw_counters_threadid)
-        {
-#    endif
-#endif
-            int __pw_retval;
-#if defined(PW_MULTITHREAD)
-            long long *values = NULL;
+    long long *overhead = &PW_thread[__pw_nthread].pw_overhead[0];
+    int        __pw_evid;
 
-            int __pw_nthread = omp_get_thread_num();
-#    if defined(PW_SAMPLING)
-            if ((__pw_retval =
-                     PAPI_accum(PW_EVTSET(__pw_nthread, __pw_evid),
-                                &(PW_VALUES(__pw_nthread, __pw_evid))))
-                != PAPI_OK)
-                PW_error(__FILE__, __LINE__, "PAPI_accum", __pw_retval);
-            PW_VALUES(__pw_nthread, __pw_evid) +=
-                (PW_OVRFLW(__pw_nthread, __pw_evid)
-                 * _pw_samplinglist[__pw_evid]);
+    overhead += which * pw_num_ctrs;
+
+#    if defined(PW_CSV)
+    fprintf(out, "%d:overhead", __pw_label);
 #    else
-        values = &PW_VALUES(__pw_nthread, __pw_evid);
-#    endif
-            if ((__pw_retval =
-                     PAPI_stop(PW_EVTSET(__pw_nthread, __pw_evid), &values[0]))
-                != PAPI_OK)
-                PW_error(__FILE__, __LINE__, "PAPI_stop", __pw_retval);
-            if ((__pw_retval =
-                     PAPI_cleanup_eventset(PW_EVTSET(__pw_nthread, __pw_evid)))
-                != PAPI_OK)
-                PW_error(
-                    __FILE__, __LINE__, "PAPI_cleanup_eventset", __pw_retval);
-            if ((__pw_retval = PAPI_destroy_eventset(
-                     &(PW_EVTSET(__pw_nthread, __pw_evid))))
-                != PAPI_OK)
-                PW_error(
-                    __FILE__, __LINE__, "PAPI_destroy_eventset", __pw_retval);
-#else
-    long long values[0];
-    if ((__pw_retval = PAPI_read(pw_eventset, &values[0])) != PAPI_OK)
-        PW_error(__FILE__, __LINE__, "PAPI_read", __pw_retval);
-    if ((__pw_retval = PAPI_stop(pw_eventset, NULL)) != PAPI_OK)
-        PW_error(__FILE__, __LINE__, "PAPI_stop", __pw_retval);
-    pw_values[__pw_evid] = values[0];
-    if ((__pw_retval = PAPI_remove_event(pw_eventset, pw_eventlist[__pw_evid]))
-        != PAPI_OK)
-        PW_error(__FILE__, __LINE__, "PAPI_remove_event", __pw_retval);
-#endif
-#if defined(_OPENMP)
-#    if !defined(PW_MULTITHREAD)
-        }
+    fprintf(out, "PAPI thread %2d:overhead\t", __pw_label);
+    if (verbose)
+        fprintf(out,
+                "time=%llu ns\n",
+                PW_thread[__pw_nthread].pw_overhead_ns[which]);
 #    endif
+    for (__pw_evid = 0; __pw_evid < pw_num_ctrs; ++__pw_evid)
+    {
+        if (verbose) fprintf(out, "%s=", _pw_eventlist[__pw_evid]);
+        fprintf(out, "%s%lld", PW_CSV_SEPARATOR, overhead[__pw_evid]);
+        if (verbose) fprintf(out, "\n");
     }
-#    pragma omp barrier
+    fprintf(out, "\n");
+}
 #endif
+
+#if defined(PW_REPETITIONS)
+/* Statistics of the repetitions of each event, in the order printed */
+#    define PW_STATS 7
+const char *pw_stats_names[PW_STATS] = {
+    "min", "median", "mean", "stddev", "ci95", "robust", "outliers"};
+
+/**
+ * @brief Quantile of sorted values, interpolating between the closest ones
+ *
+ * @param sorted Values, sorted
+ * @param n Number of values
+ * @param q Quantile, in [0, 1]
+ */
+static double
+pw_quantile(const long long *sorted, int n, double q)
+{
+    double pos = q * (n - 1);
+    int    k   = (int)pos;
+
+    if (k + 1 >= n) return (double)sorted[n - 1];
+    return sorted[k] + (pos - k) * (sorted[k + 1] - sorted[k]);
 }
 
 /**
- * @brief Starts all counters for a thread
+ * @brief Critical value of Student's t distribution for a two-sided 95%
+ * confidence interval: tabulated up to 30 degrees of freedom, approximated
+ * from the normal distribution beyond
  *
- * @param __pw_evid Counter ID
- * @param __pw_th Thread ID
+ * @param df Degrees of freedom
  */
-int
-pw_start_counter_thread(int __pw_evid, int __pw_th)
+static double
+pw_student_t95(int df)
 {
-#if !defined(_OPENMP) || !defined(PW_MULTITHREAD)
-    PW_error(__FILE__,
-             __LINE__,
-             "pw_start_counter_thread: need -fopenmp at least",
-             PAPI_EINVAL);
-#endif
-    int __pw_retval;
+    static const double t95[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447,
+                                 2.365,  2.306, 2.262, 2.228, 2.201, 2.179,
+                                 2.160,  2.145, 2.131, 2.120, 2.110, 2.101,
+                                 2.093,  2.086, 2.080, 2.074, 2.069, 2.064,
+                                 2.060,  2.056, 2.052, 2.048, 2.045, 2.042};
 
-#if defined(PW_MULTITHREAD)
-#    pragma omp barrier
-#    pragma omp critical
+    if (df <= 30) return t95[df - 1];
+    return 1.96 + 2.37 / df;
+}
+
+/**
+ * @brief Statistics of the repetitions of an event: minimum, median, mean,
+ * standard deviation, half width of its 95% confidence interval, and mean and
+ * number of the values outside Tukey's fences (1.5 interquartile ranges away
+ * from the quartiles), which are rejected as outliers
+ *
+ * @param reps Values of each repetition
+ * @param stats Statistics, in the order of pw_stats_names
+ */
+static void
+pw_stats(const long long *reps, double *stats)
+{
+    long long sorted[PW_REPETITIONS];
+    int       n   = PW_REPETITIONS;
+    double    sum = 0.0;
+    double    sq  = 0.0;
+    double    lo, hi, iqr;
+    int       inliers = 0;
+    int       k;
+
+    memcpy(sorted, reps, sizeof(sorted));
+    qsort(sorted, n, sizeof(long long), pw_compare_ll);
+    for (k = 0; k < n; ++k) sum += sorted[k];
+    stats[0] = (double)sorted[0];
+    stats[1] = pw_quantile(sorted, n, 0.5);
+    stats[2] = sum / n;
+    for (k = 0; k < n; ++k)
+    {
+        sq += (sorted[k] - stats[2]) * (sorted[k] - stats[2]);
+    }
+    stats[3] = (n > 1) ? sqrt(sq / (n - 1)) : 0.0;
+    stats[4] = (n > 1) ? pw_student_t95(n - 1) * stats[3] / sqrt(n) : 0.0;
+    iqr      = pw_quantile(sorted, n, 0.75) - pw_quantile(sorted, n, 0.25);
+    lo       = pw_quantile(sorted, n, 0.25) - 1.5 * iqr;
+    hi       = pw_quantile(sorted, n, 0.75) + 1.5 * iqr;
+    sum      = 0.0;
+    for (k = 0; k < n; ++k)
     {
-        int __pw_nthread = __pw_th;
+        if ((sorted[k] < lo) || (sorted[k] > hi)) continue;
+        sum += sorted[k];
+        ++inliers;
+    }
+    stats[5] = sum / inliers;
+    stats[6] = n - inliers;
+}
 
-        pw_dprintf(PW_D_LOW,
-                   "pw_start_counter_thread(); __pw_th = %2d __pw_evid = %2d\n",
-                   __pw_nthread,
-                   __pw_evid);
-        if ((__pw_retval = PAPI_add_event(PW_EVTSET(__pw_nthread, __pw_evid),
-                                          PW_EVTLST(__pw_nthread, __pw_evid)))
-            != PAPI_OK)
-            PW_error(__FILE__, __LINE__, "PAPI_add_event", __pw_retval);
-        if ((__pw_retval = PAPI_start(PW_EVTSET(__pw_nthread, __pw_evid)))
-            != PAPI_OK)
-            PW_error(__FILE__, __LINE__, "PAPI_start", __pw_retval);
+/**
+ * @brief Whether the execution of the region of interest a thread is in is a
+ * warm-up one
+ *
+ * @param __pw_nthread Entry of the thread in PW_thread
+ */
+static inline int
+pw_warming_up(int __pw_nthread)
+{
+    return (PW_thread[__pw_nthread].pw_run % PW_RUNS) < PW_WARMUP;
+}
+
+/**
+ * @brief Keep a value of an execution unless it is a warm-up one. After the
+ * last execution, the value is the median of the repetitions
+ *
+ * @param value Value of the execution
+ * @param reps Values of each repetition
+ * @param run Execution, warm-up ones first
+ * @param reset Empty the value for the next execution
+ */
+static void
+pw_record_value(long long *value, long long *reps, int run, int reset)
+{
+    double stats[PW_STATS];
+
+    if (run >= PW_WARMUP) reps[run - PW_WARMUP] = *value;
+    if (reset) *value = 0;
+    if (run == PW_RUNS - 1)
+    {
+        pw_stats(reps, stats);
+        *value = llround(stats[1]);
     }
-#else
-#    if defined(_OPENMP)
-    if (omp_get_thread_num() == pw_counters_threadid)
+}
+
+/**
+ * @brief Keep the values of an execution of the region of interest once the
+ * warm-up ones are over, and empty the subregions and the nodes of their
+ * tree for the next one. After the last execution of a group, the values of
+ * its events (and the calls of the nodes) are their medians
+ *
+ * @param __pw_nthread Entry of the thread in PW_thread
+ * @param __pw_grp Group id
+ */
+static void
+pw_record_run(int __pw_nthread, int __pw_grp)
+{
+    if (pw_num_variants > 0) return;
+    PW_thread_info_t *   th   = &PW_thread[__pw_nthread];
+    PW_subregion_tree_t *tree = &th->pw_tree;
+    int                  run  = th->pw_run++ % PW_RUNS;
+    int                  nsub;
+    int                  __pw_pos;
+    int                  __pw_subreg;
+    int                  node;
+
+    /* Only the subregions registered, not every slot allocated */
+    nsub = pw_num_fixed_subregions()
+           + __atomic_load_n(&pw_num_named, __ATOMIC_ACQUIRE);
+
+    for (__pw_pos = 0; __pw_pos < PW_GRP_SIZE(__pw_grp); ++__pw_pos)
     {
-#    endif
-        if ((__pw_retval = PAPI_add_event(pw_eventset, pw_eventlist[__pw_evid]))
-            != PAPI_OK)
-            PW_error(__FILE__, __LINE__, "PAPI_add_event", __pw_retval);
-        if ((__pw_retval = PAPI_start(pw_eventset)) != PAPI_OK)
-            PW_error(__FILE__, __LINE__, "PAPI_start", __pw_retval);
-#    if defined(_OPENMP)
+        int __pw_evid = PW_GRP_EVT(__pw_grp, __pw_pos);
+        pw_record_value(&PW_VALUES(__pw_nthread, __pw_evid),
+                        PW_REPS(th->pw_reps, __pw_evid),
+                        run,
+                        0);
+        for (__pw_subreg = 0; __pw_subreg < nsub; ++__pw_subreg)
+        {
+            PW_thread_subregion_t *sub =
+                pw_subregion(__pw_nthread, __pw_subreg);
+            if (sub == NULL) continue;
+            pw_record_value(&sub->pw_values[__pw_evid],
+                            PW_REPS(sub->pw_reps, __pw_evid),
+                            run,
+                            1);
+        }
+        for (node = 1; node < tree->pw_num_nodes; ++node)
+        {
+            pw_record_value(&tree->pw_nodes[node].pw_values[__pw_evid],
+                            PW_REPS(tree->pw_nodes[node].pw_reps, __pw_evid),
+                            run,
+                            1);
+        }
     }
-#        pragma omp barrier
+    /* Calls are only counted while measuring the first group */
+    for (node = 1; (__pw_grp == 0) && (node < tree->pw_num_nodes); ++node)
+    {
+        pw_record_value(&tree->pw_nodes[node].pw_calls,
+                        PW_REPS(tree->pw_nodes[node].pw_reps, pw_num_ctrs),
+                        run,
+                        1);
+    }
+}
+
+/* Value of an event of a thread in a round of a variant */
+#    define PW_VARIANT_VAL(__pw_var, __pw_round, __pw_nthread, __pw_evid)     \
+        (pw_variant_values[(((__pw_var)*PW_REPETITIONS + (__pw_round))        \
+                            * pw_num_threads                                  \
+                            + (__pw_nthread))                                 \
+                               * pw_num_ctrs                                  \
+                           + (__pw_evid)])
+
+/**
+ * @brief Pseudorandom numbers (splitmix64) for the order of the variants
+ *
+ * @param state State, advanced
+ */
+static unsigned long long
+pw_random(unsigned long long *state)
+{
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z                    = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z                    = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * @brief Plan the executions of pw_start_variants: for each group, PW_RUNS
+ * rounds in which every variant is executed once, in a random order, so
+ * drift affects all of them alike. Seeded with -DPW_VARIANTS_SEED=<n>, or
+ * with the time otherwise
+ *
+ * @param __pw_nvariants Number of variants
+ */
+void
+pw_variants_begin(int __pw_nvariants)
+{
+    int                runs = pw_num_groups * PW_RUNS * __pw_nvariants;
+    unsigned long long state;
+    int                k;
+
+    if (__pw_nvariants < 2)
+        PW_error(__FILE__,
+                 __LINE__,
+                 "pw_start_variants: at least two variants",
+                 PAPI_EINVAL);
+#    if defined(PW_VARIANTS_SEED)
+    pw_variants_seed = PW_VARIANTS_SEED;
+#    else
+    pw_variants_seed = pw_now();
 #    endif
-#endif
+    state = pw_variants_seed;
+    free(pw_variant_order);
+    free(pw_variant_values);
+    pw_num_variants      = __pw_nvariants;
+    pw_variants_measured = __pw_nvariants;
+    pw_variant_order     = (int *)malloc(sizeof(int) * runs);
+    pw_variant_values    = (long long *)calloc(
+        (size_t)__pw_nvariants * PW_REPETITIONS * pw_num_threads * pw_num_ctrs,
+        sizeof(long long));
+    for (k = 0; k < runs; k += __pw_nvariants)
+    {
+        int *order = &pw_variant_order[k];
+        int  var;
+        for (var = 0; var < __pw_nvariants; ++var) order[var] = var;
+        /* Fisher-Yates shuffle */
+        for (var = __pw_nvariants - 1; var > 0; --var)
+        {
+            int other    = pw_random(&state) % (var + 1);
+            int swap     = order[var];
+            order[var]   = order[other];
+            order[other] = swap;
+        }
+    }
+}
+
+/**
+ * @brief End the executions of pw_start_variants: later ones of the region
+ * of interest are recorded as repetitions again
+ */
+void
+pw_variants_end()
+{
+    pw_num_variants = 0;
+}
 
-    return PW_SUCCESS;
+/**
+ * @brief Variant executed in a run of pw_start_variants
+ *
+ * @param __pw_run Run number
+ */
+int
+pw_variant_get(int __pw_run)
+{
+    return pw_variant_order[__pw_run];
 }
 
 /**
- * @brief Stop each counter individually
+ * @brief Keep the values of the events of all threads in a run of
+ * pw_start_variants, unless it belongs to a warm-up round
  *
- * @param __pw_evid Counter id
+ * @param __pw_run Run number
  */
 void
-pw_stop_counter_thread(int __pw_evid, int __pw_th)
+pw_variant_record(int __pw_run)
 {
-#if !defined(_OPENMP) || !defined(PW_MULTITHREAD)
-    PW_error(__FILE__,
-             __LINE__,
-             "pw_start_counter_thread: need -fopenmp at least",
-             PAPI_EINVAL);
-#endif
-    int __pw_retval;
-#if defined(PW_MULTITHREAD)
-    long long *values       = NULL;
-    int        __pw_nthread = __pw_th;
-    values                  = &PW_VALUES(__pw_nthread, __pw_evid);
-    if ((__pw_retval =
-             PAPI_stop(PW_EVTSET(__pw_nthread, __pw_evid), &values[0]))
-        != PAPI_OK)
-        PW_error(__FILE__, __LINE__, "PAPI_stop", __pw_retval);
-    if ((__pw_retval = PAPI_remove_event(PW_EVTSET(__pw_nthread, __pw_evid),
-                                         PW_EVTLST(__pw_nthread, __pw_evid)))
-        != PAPI_OK)
-        PW_error(__FILE__, __LINE__, "PAPI_cleanup_eventset", __pw_retval);
-    pw_dprintf(
-        PW_D_LOW, "pw_stop_counter_thread(); __pw_th = %2d\n", __pw_nthread);
-    if ((__pw_retval =
-             PAPI_cleanup_eventset(PW_EVTSET(__pw_nthread, __pw_evid)))
-        != PAPI_OK)
-        PW_error(__FILE__, __LINE__, "PAPI_cleanup_eventset", __pw_retval);
-    if ((__pw_retval =
-             PAPI_destroy_eventset(&(PW_EVTSET(__pw_nthread, __pw_evid))))
-        != PAPI_OK)
-        PW_error(__FILE__, __LINE__, "PAPI_destroy_eventset", __pw_retval);
-#    pragma omp barrier
+    int per_grp  = PW_RUNS * pw_num_variants;
+    int __pw_grp = __pw_run / per_grp;
+    int round    = (__pw_run % per_grp) / pw_num_variants - PW_WARMUP;
+    int var      = pw_variant_order[__pw_run];
+    int __pw_nthread;
+    int __pw_pos;
 
-#else
-#    if defined(_OPENMP)
-    if (omp_get_thread_num() == pw_counters_threadid)
+    if (round < 0) return;
+    for (__pw_nthread = 0; __pw_nthread < pw_num_threads; ++__pw_nthread)
     {
-#    endif
-        long long values[0];
-        if ((__pw_retval = PAPI_read(pw_eventset, &values[0])) != PAPI_OK)
-            PW_error(__FILE__, __LINE__, "PAPI_read", __pw_retval);
-        if ((__pw_retval = PAPI_stop(pw_eventset, NULL)) != PAPI_OK)
-            PW_error(__FILE__, __LINE__, "PAPI_stop", __pw_retval);
-        pw_values[__pw_evid] = values[0];
-        if ((__pw_retval =
-                 PAPI_remove_event(pw_eventset, pw_eventlist[__pw_evid]))
-            != PAPI_OK)
-            PW_error(__FILE__, __LINE__, "PAPI_remove_event", __pw_retval);
-#    if defined(_OPENMP)
+        for (__pw_pos = 0; __pw_pos < PW_GRP_SIZE(__pw_grp); ++__pw_pos)
+        {
+            int __pw_evid = PW_GRP_EVT(__pw_grp, __pw_pos);
+            PW_VARIANT_VAL(var, round, __pw_nthread, __pw_evid) =
+                PW_VALUES(__pw_nthread, __pw_evid);
+        }
     }
-#        pragma omp barrier
+}
+
+/**
+ * @brief Print the statistics of the repetitions of all events of a thread,
+ * one row each
+ *
+ * @param out Stream where they are printed
+ * @param __pw_label Thread number printed
+ * @param reps Values of each repetition of the events, NULL if none
+ * @param verbose Print the names of the events
+ */
+static void
+pw_print_reps(FILE *out, int __pw_label, long long *reps, int verbose)
+{
+    double *stats = (double *)calloc(pw_num_ctrs * PW_STATS, sizeof(double));
+    int     __pw_evid;
+    int     k;
+
+    for (__pw_evid = 0; (reps != NULL) && (__pw_evid < pw_num_ctrs);
+         ++__pw_evid)
+    {
+        pw_stats(PW_REPS(reps, __pw_evid), &stats[__pw_evid * PW_STATS]);
+    }
+    for (k = 0; k < PW_STATS; ++k)
+    {
+#    if defined(PW_CSV)
+        fprintf(out, "%d:%s", __pw_label, pw_stats_names[k]);
+#    else
+        fprintf(out, "PAPI thread %2d:%s\t", __pw_label, pw_stats_names[k]);
 #    endif
-#endif
+        for (__pw_evid = 0; __pw_evid < pw_num_ctrs; ++__pw_evid)
+        {
+            if (verbose) fprintf(out, "%s=", _pw_eventlist[__pw_evid]);
+            fprintf(out,
+                    "%s%.2f",
+                    PW_CSV_SEPARATOR,
+                    stats[__pw_evid * PW_STATS + k]);
+            if (verbose) fprintf(out, "\n");
+        }
+        fprintf(out, "\n");
+    }
+    free(stats);
 }
+#endif
 
 /**
  * @brief Begin measuring subregion
  */
 void
-pw_begin_counter_subregion(int __pw_evid, int __pw_subreg_n)
+pw_begin_counter_subregion(int __pw_grp, int __pw_subreg_n)
 {
-    if (__PW_NSUBREGIONS == -1)
+#if defined(_OPENMP) && !defined(PW_MULTITHREAD)
+    /* Only the monitor thread measures: the rest of the team returns right
+     * away, without synchronizing with it */
+    if (omp_get_thread_num() != pw_counters_threadid) return;
+#endif
+    if ((__pw_subreg_n < 0)
+        || (__pw_subreg_n
+            >= pw_num_fixed_subregions()
+                   + __atomic_load_n(&pw_num_named, __ATOMIC_ACQUIRE)))
     {
         PW_error(__FILE__,
                  __LINE__,
-                 "pw_begin_counter_subregion: -1 subregions, must set",
+                 "pw_begin_counter_subregion: subregion not set with "
+                 "pw_init_start_instruments_sub nor registered",
                  PAPI_EINVAL);
-    } else if (__PW_NSUBREGIONS <= __pw_subreg_n)
+    }
+#if defined(PW_REPETITIONS)
+    /* Values of the variants are only kept for the region of interest */
+    if (pw_num_variants > 0)
     {
         PW_error(__FILE__,
                  __LINE__,
-                 "pw_begin_counter_subregion: subregion number above "
-                 "the specified",
+                 "pw_begin_counter_subregion: subregions are not supported "
+                 "within pw_start_variants",
                  PAPI_EINVAL);
     }
-#if defined(_OPENMP)
-    int __pw_nthread = omp_get_thread_num();
-#    if !defined(PW_MULTITHREAD)
-    if (__pw_nthread == pw_counters_threadid)
-    {
-#    endif
 #endif
-        int __pw_retval;
-#if defined(PW_MULTITHREAD)
-        if ((__pw_retval =
-                 PAPI_read(
-                     PW_EVTSET(__pw_nthread, __pw_evid),
-                     &PW_SUBREG_DELTA(__pw_nthread, __pw_evid, __pw_subreg_n))
-                 != PAPI_OK))
-            PW_error(__FILE__, __LINE__, "PAPI_read", __pw_retval);
-
-#else
+    int __pw_nthread = pw_thread_id();
     pw_dprintf(PW_D_LOW,
-               "pw_begin_subregion(); __pw_th = %2d __pw_evid = %2d",
-               0,
-               __pw_evid);
-    if ((__pw_retval = PAPI_read(pw_eventset,
-                                 &PW_SUBREG_DELTA(0, __pw_evid, __pw_subreg_n))
-                       != PAPI_OK))
-        PW_error(__FILE__, __LINE__, "PAPI_read", __pw_retval);
-#endif
-#if defined(_OPENMP)
-#    if !defined(PW_MULTITHREAD)
-    }
-#        pragma omp barrier
-#    endif
+               "pw_begin_subregion(); __pw_th = %2d __pw_grp = %2d",
+               __pw_nthread,
+               __pw_grp);
+    pw_subregion_reserve(__pw_nthread, __pw_subreg_n);
+    long long *delta = pw_tree_push(__pw_nthread, __pw_subreg_n);
+#if defined(PW_TRACE)
+    PW_subregion_tree_t *tree = &PW_thread[__pw_nthread].pw_tree;
+    tree->pw_begins[tree->pw_depth - 1] = pw_now();
 #endif
+    pw_read_eventset(__pw_nthread, __pw_grp, delta);
 }
 
 /**
- * @brief Read counter in a concrete subregion
+ * @brief Read counters in a concrete subregion: a single PAPI_read returns all
+ * the events of the group
  *
  */
 void
-pw_end_counter_subregion(int __pw_evid, int __pw_subreg_n)
+pw_end_counter_subregion(int __pw_grp, int __pw_subreg_n)
 {
-    if (__PW_NSUBREGIONS == -1)
+#if defined(_OPENMP) && !defined(PW_MULTITHREAD)
+    /* As in pw_begin_counter_subregion, no synchronization */
+    if (omp_get_thread_num() != pw_counters_threadid) return;
+#endif
+    if ((__pw_subreg_n < 0)
+        || (__pw_subreg_n
+            >= pw_num_fixed_subregions()
+                   + __atomic_load_n(&pw_num_named, __ATOMIC_ACQUIRE)))
     {
         PW_error(__FILE__,
                  __LINE__,
-                 "pw_begin_counter_subregion: -1 subregions, must set",
+                 "pw_end_counter_subregion: subregion not set with "
+                 "pw_init_start_instruments_sub nor registered",
                  PAPI_EINVAL);
-    } else if (__PW_NSUBREGIONS <= __pw_subreg_n)
+    }
+    int                    __pw_nthread = pw_thread_id();
+    int                    __pw_pos;
+    long long              values[PW_GRP_SIZE(__pw_grp)];
+    PW_thread_subregion_t *sub;
+    PW_subregion_tree_t *  tree = &PW_thread[__pw_nthread].pw_tree;
+    PW_subregion_node_t *  node;
+    long long *            delta;
+    pw_read_eventset(__pw_nthread, __pw_grp, values);
+#if defined(PW_TRACE)
+    unsigned long long __pw_end = pw_now();
+#endif
+    if ((tree->pw_depth == 0)
+        || (tree->pw_nodes[tree->pw_stack[tree->pw_depth - 1]].pw_subreg
+            != __pw_subreg_n))
     {
         PW_error(__FILE__,
                  __LINE__,
-                 "pw_begin_counter_subregion: subregion number above the "
-                 "specified",
+                 "pw_end_counter_subregion: subregion not open, or ended "
+                 "before the ones nested in it",
                  PAPI_EINVAL);
     }
-    int       __pw_retval;
-    long long values[1] = {0};
-#if defined(_OPENMP)
-    int __pw_nthread = omp_get_thread_num();
-#    if !defined(PW_MULTITHREAD)
-    if (__pw_nthread == pw_counters_threadid)
+    tree->pw_depth--;
+    node  = &tree->pw_nodes[tree->pw_stack[tree->pw_depth]];
+    delta = tree->pw_deltas[tree->pw_depth];
+    sub   = pw_subregion(__pw_nthread, __pw_subreg_n);
+    /* Each execution measures a group: count calls only once */
+    if (__pw_grp == 0) node->pw_calls++;
+    for (__pw_pos = 0; __pw_pos < PW_GRP_SIZE(__pw_grp); ++__pw_pos)
     {
-#    endif
+        int       __pw_evid = PW_GRP_EVT(__pw_grp, __pw_pos);
+        long long __pw_diff = values[__pw_pos] - delta[__pw_pos];
+#if defined(PW_CALIBRATE_SUBTRACT)
+        __pw_diff -= PW_OVERHEAD_SUB(__pw_nthread, __pw_evid);
+        if (__pw_diff < 0) __pw_diff = 0;
 #endif
-#if defined(PW_MULTITHREAD)
-        if ((__pw_retval =
-                 PAPI_read(PW_EVTSET(__pw_nthread, __pw_evid), &values[0]))
-            != PAPI_OK)
-            PW_error(__FILE__, __LINE__, "PAPI_read", __pw_retval);
-        PW_SUBREG_VAL(__pw_nthread, __pw_evid, __pw_subreg_n) +=
-            (values[0]
-             - PW_SUBREG_DELTA(__pw_nthread, __pw_evid, __pw_subreg_n));
-#else
-    if ((__pw_retval = PAPI_read(pw_eventset, &values[0])) != PAPI_OK)
-        PW_error(__FILE__, __LINE__, "PAPI_read", __pw_retval);
-    PW_SUBREG_VAL(0, __pw_evid, __pw_subreg_n) +=
-        (values[0] - PW_SUBREG_DELTA(0, __pw_evid, __pw_subreg_n));
+        sub->pw_values[__pw_evid] += __pw_diff;
+        node->pw_values[__pw_evid] += __pw_diff;
+#if defined(PW_HISTOGRAM) && defined(PW_REPETITIONS)
+        if (!pw_warming_up(__pw_nthread))
+            pw_hist_record(&sub->pw_hist[__pw_evid], __pw_diff);
+#elif defined(PW_HISTOGRAM)
+        pw_hist_record(&sub->pw_hist[__pw_evid], __pw_diff);
 #endif
-#if defined(_OPENMP)
-#    if !defined(PW_MULTITHREAD)
     }
-#        pragma omp barrier
-#    endif
+#if defined(PW_CALIBRATE)
+    if (pw_calibrating) return;
+#endif
+#if defined(PW_TRACE)
+    pw_trace_append(__pw_nthread,
+                    __pw_grp,
+                    __pw_subreg_n,
+                    tree->pw_begins[tree->pw_depth],
+                    __pw_end,
+                    values,
+                    delta);
 #endif
 }
 
 #ifdef PW_FILE
 #    define PRINT_OUT(...) fprintf(fp, __VA_ARGS__)
+#    define PRINT_FP fp
 #else
 #    define PRINT_OUT(...) printf(__VA_ARGS__)
+#    define PRINT_FP stdout
 #endif
 
 /**
@@ -1001,11 +4842,37 @@ pw_print()
                     if (verbose) PRINT_OUT("\n");
                 }
                 PRINT_OUT("\n");
-            }
-#    pragma omp barrier
-#    pragma omp master
-            {
-                free(PW_thread);
+#    if defined(PW_REPETITIONS)
+                /* Values are the medians of the repetitions */
+                pw_print_reps(PRINT_FP,
+                              __pw_nthread,
+                              PW_thread[__pw_nthread].pw_reps,
+                              verbose);
+#    endif
+#    if defined(PW_CALIBRATE)
+                pw_print_overhead(
+                    PRINT_FP, __pw_nthread, __pw_nthread, 0, verbose);
+#    endif
+#    if defined(PW_PERF_MPX)
+                /* Values are scaled; coverage is how much they were counted.
+                 * Subregions have none: their values are differences of
+                 * scaled reads, i.e. estimates too */
+#        if defined(PW_CSV)
+                PRINT_OUT("%d:coverage", __pw_nthread);
+#        else
+                PRINT_OUT("PAPI thread %2d:coverage\t", __pw_nthread);
+#        endif
+                for (__pw_evid = 0; PW_EVTLST(__pw_nthread, __pw_evid) != 0;
+                     ++__pw_evid)
+                {
+                    if (verbose) PRINT_OUT("%s=", _pw_eventlist[__pw_evid]);
+                    PRINT_OUT("%s%.3f",
+                              PW_CSV_SEPARATOR,
+                              PW_COVERAGE(__pw_nthread, __pw_evid));
+                    if (verbose) PRINT_OUT("\n");
+                }
+                PRINT_OUT("\n");
+#    endif
             }
 #else
 #    if defined(PW_CSV)
@@ -1016,10 +4883,31 @@ pw_print()
     for (__pw_evid = 0; pw_eventlist[__pw_evid] != 0; ++__pw_evid)
     {
         if (verbose) PRINT_OUT("%s=", _pw_eventlist[__pw_evid]);
-        PRINT_OUT("%s%llu", PW_CSV_SEPARATOR, pw_values[__pw_evid]);
+        PRINT_OUT("%s%llu", PW_CSV_SEPARATOR, PW_VALUES(0, __pw_evid));
+        if (verbose) PRINT_OUT("\n");
+    }
+    PRINT_OUT("\n");
+#    if defined(PW_REPETITIONS)
+    pw_print_reps(
+        PRINT_FP, pw_counters_threadid, PW_thread[0].pw_reps, verbose);
+#    endif
+#    if defined(PW_CALIBRATE)
+    pw_print_overhead(PRINT_FP, 0, pw_counters_threadid, 0, verbose);
+#    endif
+#    if defined(PW_PERF_MPX)
+#        if defined(PW_CSV)
+    PRINT_OUT("%d:coverage", pw_counters_threadid);
+#        else
+    PRINT_OUT("PAPI thread %2d:coverage\t", pw_counters_threadid);
+#        endif
+    for (__pw_evid = 0; pw_eventlist[__pw_evid] != 0; ++__pw_evid)
+    {
+        if (verbose) PRINT_OUT("%s=", _pw_eventlist[__pw_evid]);
+        PRINT_OUT("%s%.3f", PW_CSV_SEPARATOR, PW_COVERAGE(0, __pw_evid));
         if (verbose) PRINT_OUT("\n");
     }
     PRINT_OUT("\n");
+#    endif
 #endif
 #if defined(_OPENMP)
 #    if !defined(PW_MULTITHREAD)
@@ -1034,13 +4922,188 @@ pw_print()
 }
 
 /**
- * @brief Printing the values of the counters and its subregions
+ * @brief Print the values of a subregion measured by a thread
+ *
+ * @param __pw_nthread Thread number (entry of PW_thread)
+ * @param __pw_label Thread number printed
+ * @param __pw_subreg Subregion id
+ * @param verbose Print the names of the events
+ */
+static void
+pw_print_subregion_thread(int __pw_nthread,
+                          int __pw_label,
+                          int __pw_subreg,
+                          int verbose)
+{
+    /* Threads allocate named subregions the first time they measure them */
+    PW_thread_subregion_t *sub = pw_subregion(__pw_nthread, __pw_subreg);
+    int                    __pw_evid;
+
+#if defined(PW_CSV)
+    printf("%d", __pw_label);
+#else
+    printf("PAPI thread %2d\t", __pw_label);
+#endif
+    for (__pw_evid = 0; PW_EVTLST(__pw_nthread, __pw_evid) != 0; ++__pw_evid)
+    {
+        if (verbose) printf("%s=", _pw_eventlist[__pw_evid]);
+        printf("%s%llu",
+               PW_CSV_SEPARATOR,
+               (sub != NULL) ? sub->pw_values[__pw_evid] : 0);
+        if (verbose) printf("\n");
+    }
+    printf("\n");
+#if defined(PW_REPETITIONS)
+    pw_print_reps(
+        stdout, __pw_label, (sub != NULL) ? sub->pw_reps : NULL, verbose);
+#endif
+#if defined(PW_CALIBRATE)
+    /* Overhead of each call */
+    pw_print_overhead(stdout, __pw_nthread, __pw_label, 1, verbose);
+#endif
+#if defined(PW_HISTOGRAM)
+    /* Number of calls and distribution of the values of each call */
+    const char *stat[] = {"calls", "min", "p50", "p99", "max"};
+    int         k;
+    for (k = 0; k < 5; ++k)
+    {
+#    if defined(PW_CSV)
+        printf("%d:%s", __pw_label, stat[k]);
+#    else
+        printf("PAPI thread %2d:%s\t", __pw_label, stat[k]);
+#    endif
+        for (__pw_evid = 0; PW_EVTLST(__pw_nthread, __pw_evid) != 0;
+             ++__pw_evid)
+        {
+            PW_histogram_t *hist = (sub != NULL) ? &sub->pw_hist[__pw_evid]
+                                                 : NULL;
+            long long       value = 0;
+            if ((hist != NULL) && (hist->pw_count > 0))
+            {
+                if (k == 0) value = hist->pw_count;
+                if (k == 1) value = hist->pw_min;
+                if (k == 2) value = pw_hist_quantile(hist, 0.5);
+                if (k == 3) value = pw_hist_quantile(hist, 0.99);
+                if (k == 4) value = hist->pw_max;
+            }
+            if (verbose) printf("%s=", _pw_eventlist[__pw_evid]);
+            printf("%s%lld", PW_CSV_SEPARATOR, value);
+            if (verbose) printf("\n");
+        }
+        printf("\n");
+    }
+#endif
+}
+
+/**
+ * @brief Print the nodes of the tree of nested subregions of a thread, in
+ * preorder, with their path from the root, number of calls, and inclusive and
+ * exclusive (without the subregions nested) values
+ *
+ * @param tree Tree of the thread
+ * @param node Node to print, along with the nodes nested in it
+ * @param __pw_label Thread number printed
+ * @param path Path of the parent node, extended in place
+ * @param verbose Print the names of the events
+ */
+static void
+pw_print_tree_node(PW_subregion_tree_t *tree,
+                   int                  node,
+                   int                  __pw_label,
+                   char *               path,
+                   int                  verbose)
+{
+    PW_subregion_node_t *n   = &tree->pw_nodes[node];
+    size_t               len = strlen(path);
+    int                  __pw_evid;
+    int                  child;
+
+    if (n->pw_subreg >= pw_num_fixed_subregions())
+        snprintf(path + len,
+                 PW_PATH_MAX - len,
+                 "%s%s",
+                 (len > 0) ? "/" : "",
+                 pw_named_names[n->pw_subreg - pw_num_fixed_subregions()]);
+    else
+        snprintf(path + len,
+                 PW_PATH_MAX - len,
+                 "%s%d",
+                 (len > 0) ? "/" : "",
+                 n->pw_subreg);
+#if defined(PW_CSV)
+    printf("%d%s%s%s%lld",
+           __pw_label,
+           PW_CSV_SEPARATOR,
+           path,
+           PW_CSV_SEPARATOR,
+           n->pw_calls);
+#else
+    printf(
+        "PAPI thread %2d\t%s\tcalls=%lld\t", __pw_label, path, n->pw_calls);
+#endif
+    for (__pw_evid = 0; pw_eventlist[__pw_evid] != 0; ++__pw_evid)
+    {
+        if (verbose) printf("\n%s(incl)=", _pw_eventlist[__pw_evid]);
+        printf("%s%llu", PW_CSV_SEPARATOR, n->pw_values[__pw_evid]);
+    }
+    for (__pw_evid = 0; pw_eventlist[__pw_evid] != 0; ++__pw_evid)
+    {
+        long long excl = n->pw_values[__pw_evid];
+        for (child = n->pw_child; child != -1;
+             child = tree->pw_nodes[child].pw_sibling)
+        {
+            excl -= tree->pw_nodes[child].pw_values[__pw_evid];
+        }
+        if (verbose) printf("\n%s(excl)=", _pw_eventlist[__pw_evid]);
+        printf("%s%lld", PW_CSV_SEPARATOR, excl);
+    }
+    printf("\n");
+    for (child = n->pw_child; child != -1;
+         child = tree->pw_nodes[child].pw_sibling)
+    {
+        pw_print_tree_node(tree, child, __pw_label, path, verbose);
+    }
+    path[len] = '\0';
+}
+
+/**
+ * @brief Print the tree of nested subregions of a thread
+ *
+ * @param __pw_nthread Thread number (entry of PW_thread)
+ * @param __pw_label Thread number printed
+ * @param verbose Print the names of the events
+ */
+static void
+pw_print_tree_thread(int __pw_nthread, int __pw_label, int verbose)
+{
+    PW_subregion_tree_t *tree = &PW_thread[__pw_nthread].pw_tree;
+    char                 path[PW_PATH_MAX] = "";
+    int                  node;
+
+    if (tree->pw_num_nodes == 0) return;
+    for (node = tree->pw_nodes[0].pw_child; node != -1;
+         node = tree->pw_nodes[node].pw_sibling)
+    {
+        pw_print_tree_node(tree, node, __pw_label, path, verbose);
+    }
+}
+
+/**
+ * @brief Printing the values of the counters and its subregions, either set
+ * with pw_init_start_instruments_sub or registered by name. When subregions
+ * are nested, their tree follows
  *
  */
 void
 pw_print_sub()
 {
-    if (__PW_NSUBREGIONS == -1)
+    int __pw_nsubregs = pw_num_fixed_subregions() + pw_num_named;
+    int __pw_nhidden  = 0;
+#if defined(PW_CALIBRATE)
+    /* The subregion measured by pw_calibrate */
+    __pw_nhidden = (pw_calibrate_subreg != -1);
+#endif
+    if (__pw_nsubregs == __pw_nhidden)
     {
         PW_error(__FILE__,
                  __LINE__,
@@ -1059,9 +5122,11 @@ pw_print_sub()
         {
 #    endif
 #endif
-            int __pw_evid;
+            int __pw_nthread;
+            int __pw_subreg;
 
 #if defined(PW_CSV)
+            int __pw_evid;
             printf("PAPI_thread");
             for (__pw_evid = 0; _pw_eventlist[__pw_evid] != NULL; ++__pw_evid)
             {
@@ -1069,62 +5134,80 @@ pw_print_sub()
             }
             printf("\n");
 #endif
-#if defined(PW_MULTITHREAD)
-            int __pw_nthreads = 1;
-#    pragma omp parallel
+            for (__pw_subreg = 0; __pw_subreg < __pw_nsubregs; ++__pw_subreg)
             {
-#    pragma omp master
+                const char *name = NULL;
+#if defined(PW_CALIBRATE)
+                if (__pw_subreg == pw_calibrate_subreg) continue;
+#endif
+                if (__pw_subreg >= pw_num_fixed_subregions())
+                    name =
+                        pw_named_names[__pw_subreg - pw_num_fixed_subregions()];
+                if (name != NULL)
+                    printf("== BEGIN SUBREGION %s ==\n", name);
+                else
+                    printf("== BEGIN SUBREGION %d ==\n", __pw_subreg);
+#if defined(PW_MULTITHREAD)
+                for (__pw_nthread = 0; __pw_nthread < pw_num_threads;
+                     ++__pw_nthread)
                 {
-                    __pw_nthreads = omp_get_num_threads();
+                    pw_print_subregion_thread(
+                        __pw_nthread, __pw_nthread, __pw_subreg, verbose);
                 }
+#else
+                __pw_nthread = 0;
+                pw_print_subregion_thread(
+                    __pw_nthread, pw_counters_threadid, __pw_subreg, verbose);
+#endif
+                if (name != NULL)
+                    printf("== END SUBREGION %s ==\n", name);
+                else
+                    printf("== END SUBREGION %d ==\n", __pw_subreg);
             }
-            int __pw_nthread = 0;
-#    pragma omp for ordered schedule(static, 1)
-            for (int __pw_subreg = 0; __pw_subreg < __PW_NSUBREGIONS;
-                 ++__pw_subreg)
+            int __pw_nested = 0;
+            for (__pw_nthread = 0; __pw_nthread < pw_num_threads;
+                 ++__pw_nthread)
             {
-                printf("== BEGIN SUBREGION %d ==\n", __pw_subreg);
-                for (__pw_nthread = 0; __pw_nthread < __pw_nthreads;
-                     ++__pw_nthread)
+                PW_subregion_tree_t *tree = &PW_thread[__pw_nthread].pw_tree;
+                for (__pw_subreg = 1; __pw_subreg < tree->pw_num_nodes;
+                     ++__pw_subreg)
                 {
-#    if defined(PW_CSV)
-                    printf("%d", __pw_nthread);
-#    else
-            printf("PAPI thread %2d\t", __pw_nthread);
-#    endif
-                    for (__pw_evid = 0; PW_EVTLST(__pw_nthread, __pw_evid) != 0;
-                         ++__pw_evid)
-                    {
-                        if (verbose) printf("%s=", _pw_eventlist[__pw_evid]);
-                        printf("%s%llu",
-                               PW_CSV_SEPARATOR,
-                               PW_SUBREG_VAL(
-                                   __pw_nthread, __pw_evid, __pw_subreg));
-                        if (verbose) printf("\n");
-                    }
-                    printf("\n");
+                    if (tree->pw_nodes[__pw_subreg].pw_parent != 0)
+                        __pw_nested = 1;
                 }
-                printf("== END SUBREGION %d ==\n", __pw_subreg);
             }
-#    pragma omp barrier
-#    pragma omp master
+            if (__pw_nested)
             {
-                free(PW_thread);
-            }
+                printf("== BEGIN SUBREGION TREE ==\n");
+#if defined(PW_CSV)
+                printf("PAPI_thread%ssubregion%scalls",
+                       PW_CSV_SEPARATOR,
+                       PW_CSV_SEPARATOR);
+                for (__pw_evid = 0; _pw_eventlist[__pw_evid] != NULL;
+                     ++__pw_evid)
+                {
+                    printf("%s%s", PW_CSV_SEPARATOR, _pw_eventlist[__pw_evid]);
+                }
+                for (__pw_evid = 0; _pw_eventlist[__pw_evid] != NULL;
+                     ++__pw_evid)
+                {
+                    printf("%sexcl_%s",
+                           PW_CSV_SEPARATOR,
+                           _pw_eventlist[__pw_evid]);
+                }
+                printf("\n");
+#endif
+#if defined(PW_MULTITHREAD)
+                for (__pw_nthread = 0; __pw_nthread < pw_num_threads;
+                     ++__pw_nthread)
+                {
+                    pw_print_tree_thread(__pw_nthread, __pw_nthread, verbose);
+                }
 #else
-#    if defined(PW_CSV)
-    printf("%d", pw_counters_threadid);
-#    else
-    printf("PAPI thread %2d\t", pw_counters_threadid);
-#    endif
-    for (__pw_evid = 0; pw_eventlist[__pw_evid] != 0; ++__pw_evid)
-    {
-        if (verbose) printf("%s=", _pw_eventlist[__pw_evid]);
-        printf("%s%llu", PW_CSV_SEPARATOR, pw_values[__pw_evid]);
-        if (verbose) printf("\n");
-    }
-    printf("\n");
+                pw_print_tree_thread(0, pw_counters_threadid, verbose);
 #endif
+                printf("== END SUBREGION TREE ==\n");
+            }
 #if defined(_OPENMP)
 #    if !defined(PW_MULTITHREAD)
         }
@@ -1133,3 +5216,120 @@ pw_print_sub()
 #    endif
 #endif
 }
+
+#if defined(PW_REPETITIONS)
+/**
+ * @brief Print the variants measured with pw_start_variants: for each thread,
+ * the statistics of the rounds of each variant and, for the rest of variants,
+ * their differences with the first one paired by round (as values and as
+ * percentage of the mean of the first one, 0 if that mean is 0), the 95%
+ * confidence interval of the difference, its t statistic, and whether it is
+ * significant (1) or not
+ */
+void
+pw_print_var()
+{
+    const char *diff[] = {
+        "diff", "diff%", "diff_ci95", "t", "significant"};
+    int         ncols  = PW_STATS + 5;
+    double *    rows = (double *)malloc(sizeof(double) * ncols * pw_num_ctrs);
+    double      t95  = (PW_REPETITIONS > 1) ? pw_student_t95(PW_REPETITIONS - 1)
+                                            : INFINITY;
+    int         verbose = 0;
+    int         __pw_nthread;
+    int         __pw_evid;
+    int         var;
+    int         k;
+
+    if (pw_variants_measured == 0)
+    {
+        PW_error(__FILE__,
+                 __LINE__,
+                 "pw_print_variants: no variants to print",
+                 PAPI_EINVAL);
+    }
+#    if defined(PW_VERBOSE) && !defined(PW_CSV)
+    verbose = 1;
+#    endif
+    printf("== BEGIN VARIANTS (%d rounds, seed %llu) ==\n",
+           PW_REPETITIONS,
+           pw_variants_seed);
+#    if defined(PW_CSV)
+    printf("PAPI_thread");
+    for (__pw_evid = 0; __pw_evid < pw_num_ctrs; ++__pw_evid)
+    {
+        printf("%s%s", PW_CSV_SEPARATOR, _pw_eventlist[__pw_evid]);
+    }
+    printf("\n");
+#    endif
+    for (__pw_nthread = 0; __pw_nthread < pw_num_threads; ++__pw_nthread)
+    {
+#    if defined(PW_MULTITHREAD)
+        int __pw_label = __pw_nthread;
+#    else
+        int __pw_label = pw_counters_threadid;
+#    endif
+        for (var = 0; var < pw_variants_measured; ++var)
+        {
+            for (__pw_evid = 0; __pw_evid < pw_num_ctrs; ++__pw_evid)
+            {
+                long long reps[PW_REPETITIONS];
+                long long diffs[PW_REPETITIONS];
+                double    base[PW_STATS];
+                double    paired[PW_STATS];
+                double *  row = &rows[__pw_evid * ncols];
+                double    sem;
+                int       round;
+                for (round = 0; round < PW_REPETITIONS; ++round)
+                {
+                    reps[round] =
+                        PW_VARIANT_VAL(var, round, __pw_nthread, __pw_evid);
+                    diffs[round] =
+                        reps[round]
+                        - PW_VARIANT_VAL(0, round, __pw_nthread, __pw_evid);
+                }
+                pw_stats(reps, row);
+                if (var == 0) continue;
+                /* Differences with the first variant, paired by round */
+                for (round = 0; round < PW_REPETITIONS; ++round)
+                {
+                    reps[round] -= diffs[round];
+                }
+                pw_stats(reps, base);
+                pw_stats(diffs, paired);
+                sem               = paired[3] / sqrt(PW_REPETITIONS);
+                row[PW_STATS]     = paired[2];
+                /* No percentage of a mean of 0 (e.g. no page faults) */
+                row[PW_STATS + 1] =
+                    (base[2] != 0.0) ? 100.0 * paired[2] / base[2] : 0.0;
+                row[PW_STATS + 2] = paired[4];
+                row[PW_STATS + 3] = (sem > 0.0) ? paired[2] / sem
+                                                : copysign(INFINITY, paired[2]);
+                if (paired[2] == 0.0) row[PW_STATS + 3] = 0.0;
+                row[PW_STATS + 4] = fabs(row[PW_STATS + 3]) > t95;
+            }
+            for (k = 0; k < ((var == 0) ? PW_STATS : ncols); ++k)
+            {
+                const char *name =
+                    (k < PW_STATS) ? pw_stats_names[k] : diff[k - PW_STATS];
+#    if defined(PW_CSV)
+                printf("%d:v%d:%s", __pw_label, var, name);
+#    else
+                printf("PAPI thread %2d:v%d:%s\t", __pw_label, var, name);
+#    endif
+                for (__pw_evid = 0; __pw_evid < pw_num_ctrs; ++__pw_evid)
+                {
+                    if (verbose) printf("%s=", _pw_eventlist[__pw_evid]);
+                    printf("%s%.2f",
+                           PW_CSV_SEPARATOR,
+                           rows[__pw_evid * ncols + k]);
+                    if (verbose) printf("\n");
+                }
+                printf("\n");
+            }
+        }
+    }
+    printf("== END VARIANTS ==\n");
+    free(rows);
+}
+#endif
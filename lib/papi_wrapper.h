@@ -27,8 +27,34 @@
 #if !defined(PAPI_WRAPPER_H)
 #    define PAPI_WRAPPER_H
 
-/* Need to compile with -lpapi flag */
-#    include <papi.h>
+/* Need to compile with -lpapi flag, unless using the perf_event backend */
+#    if !defined(PW_BACKEND_PERF)
+#        include <papi.h>
+#    else
+/* Same values as in papi.h, so -DPW_DOM and -DPW_GRN do not change */
+#        define PAPI_OK 0
+#        define PAPI_EINVAL -1
+#        define PAPI_ESYS -3
+#        define PAPI_ENOEVNT -7
+#        define PAPI_DOM_USER 0x1
+#        define PAPI_DOM_MIN PAPI_DOM_USER
+#        define PAPI_DOM_KERNEL 0x2
+#        define PAPI_DOM_OTHER 0x4
+#        define PAPI_DOM_SUPERVISOR 0x8
+#        define PAPI_DOM_ALL                                  \
+            (PAPI_DOM_USER | PAPI_DOM_KERNEL | PAPI_DOM_OTHER \
+             | PAPI_DOM_SUPERVISOR)
+#        define PAPI_DOM_MAX PAPI_DOM_ALL
+#        define PAPI_GRN_THR 0x1
+#        define PAPI_GRN_MIN PAPI_GRN_THR
+#        define PAPI_GRN_PROC 0x2
+#        define PAPI_GRN_PROCG 0x4
+#        define PAPI_GRN_SYS 0x8
+#        define PAPI_GRN_SYS_CPU 0x10
+#        define PAPI_GRN_MAX PAPI_GRN_SYS_CPU
+#    endif
+
+#    include <stddef.h>
 
 /* Defined macros */
 #    define PW_D_LOW 0x01
@@ -38,9 +64,17 @@
 
 #    define PW_SNG_EXC 0x10
 #    define PW_ALL_EXC 0x11
+#    define PW_MPX_EXC 0x12
+
+#    define PW_FLUSH_CLFLUSH 0x20
+#    define PW_FLUSH_CLFLUSHOPT 0x21
+#    define PW_FLUSH_STREAM 0x22
+
+#    define PW_CACHE_COLD 0x30
+#    define PW_CACHE_WARM 0x31
+#    define PW_CACHE_NONE 0x32
 
-#    define PW_NUM_EVTSET 4096
-#    define PW_MAX_COUNTERS 4096
+#    define PW_CACHE_LINE 64
 
 #    define PW_SUCCESS 0x0
 #    define PW_ERR 0x1
@@ -61,14 +95,33 @@
 #        define PW_EXEC_MODE PW_SNG_EXC
 #    endif
 
+/* Default cache flush strategy (-DPW_FLUSH): clflush only on x86-64 */
+#    if !defined(PW_FLUSH)
+#        define PW_FLUSH PW_FLUSH_CLFLUSH
+#    endif
+#    if (PW_FLUSH != PW_FLUSH_STREAM) && !defined(__x86_64__)
+#        undef PW_FLUSH
+#        define PW_FLUSH PW_FLUSH_STREAM
+#    endif
+
+/* Default state of caches before each execution (-DPW_CACHE_MODE): flushed */
+#    if !defined(PW_CACHE_MODE)
+#        define PW_CACHE_MODE PW_CACHE_COLD
+#    endif
+
 /* Default granularity (-DPW_GRN) for all EventSets*/
 #    if !defined(PW_GRN)
 #        define PW_GRN PAPI_GRN_THR
 #    endif
 
-/* Default domain (-DPW_DOM) for each EventSet */
+/* Default domain (-DPW_DOM) for each EventSet; user for the perf_event
+ * backend, as kernel events need perf_event_paranoid < 2 */
 #    if !defined(PW_DOM)
-#        define PW_DOM PAPI_DOM_KERNEL
+#        if defined(PW_BACKEND_PERF)
+#            define PW_DOM PAPI_DOM_USER
+#        else
+#            define PW_DOM PAPI_DOM_KERNEL
+#        endif
 #    endif
 
 /* Default comma separator for CSV format */
@@ -94,43 +147,230 @@
 
 #    define PAPI_WRAPPER_CLOSE_RESULTS_FILE fclose(fp);
 
+/* Executions of the region of interest per group of events: -DPW_WARMUP=<n>
+ * warm-up ones, whose values are discarded, then -DPW_REPETITIONS=<n> */
+#    if defined(PW_REPETITIONS)
+#        if !defined(PW_WARMUP)
+#            define PW_WARMUP 0
+#        endif
+#        define PW_RUNS (PW_WARMUP + PW_REPETITIONS)
+#    else
+#        define PW_RUNS 1
+#    endif
+
+/* Overhead of the wrapper measured in pw_init: -DPW_CALIBRATE, also implied
+ * by -DPW_CALIBRATE_SUBTRACT, which subtracts it from the values */
+#    if defined(PW_CALIBRATE_SUBTRACT) && !defined(PW_CALIBRATE)
+#        define PW_CALIBRATE
+#    endif
+
+#    if defined(PW_HISTOGRAM)
+/* Values below 2^PW_HIST_SUB_BITS have their own bucket; above, each power of
+ * two is split in 2^PW_HIST_SUB_BITS buckets (12.5% of relative error) */
+#        define PW_HIST_SUB_BITS 3
+#        define PW_HIST_SUB (1 << PW_HIST_SUB_BITS)
+#        define PW_HIST_BUCKETS (PW_HIST_SUB * (64 - PW_HIST_SUB_BITS + 1))
+
+/**
+ * @brief Histogram of the values of an event in each call of a subregion,
+ * with buckets growing logarithmically so its size is fixed
+ */
+typedef struct PW_histogram
+{
+    long long    pw_count;
+    long long    pw_min;
+    long long    pw_max;
+    unsigned int pw_buckets[PW_HIST_BUCKETS];
+} PW_histogram_t;
+#    endif
+
 typedef struct PW_thread_subregion
 {
-    long long  pw_delta;
     long long *pw_values;
+#    if defined(PW_HISTOGRAM)
+    PW_histogram_t *pw_hist;
+#    endif
+#    if defined(PW_REPETITIONS)
+    long long *pw_reps;
+#    endif
 } PW_thread_subregion_t;
 
+/**
+ * @brief Node of the tree of nested subregions of a thread: one per path of
+ * subregions from the root (node 0), holding its inclusive values (and those
+ * of each repetition, followed by its calls)
+ */
+typedef struct PW_subregion_node
+{
+    int        pw_subreg;
+    int        pw_parent;
+    int        pw_child;
+    int        pw_sibling;
+    long long  pw_calls;
+    long long *pw_values;
+#    if defined(PW_REPETITIONS)
+    long long *pw_reps;
+#    endif
+} PW_subregion_node_t;
+
+/**
+ * @brief Tree of nested subregions of a thread, and stack of the subregions
+ * open, with the values of the counters when they began
+ */
+typedef struct PW_subregion_tree
+{
+    PW_subregion_node_t *pw_nodes;
+    int                  pw_num_nodes;
+    int                  pw_nodes_cap;
+    int                 *pw_stack;
+    long long          **pw_deltas;
+#    if defined(PW_TRACE)
+    unsigned long long *pw_begins;
+#    endif
+    int pw_depth;
+    int pw_stack_cap;
+} PW_subregion_tree_t;
+
+#    if defined(PW_TRACE)
+#        if !defined(PW_TRACE_FILENAME)
+#            define PW_TRACE_FILENAME "/tmp/__tmp_papi_wrapper.trace"
+#        endif
+/* Records of the ring buffer of each thread, must be a power of two */
+#        if !defined(PW_TRACE_RECORDS)
+#            define PW_TRACE_RECORDS 8192
+#        endif
+
+/**
+ * @brief Record of a call of a subregion in the trace (times in ns), followed
+ * by the values of the events of its group. Subregion -1 is the execution of
+ * the region of interest, between pw_start_instruments and pw_stop_instruments
+ */
+typedef struct PW_trace_record
+{
+    unsigned long long pw_begin;
+    unsigned long long pw_end;
+    int                pw_thread;
+    int                pw_cpu;
+    int                pw_subreg;
+    int                pw_group;
+} PW_trace_record_t;
+
+/**
+ * @brief Ring buffer of the records of a thread: only the thread appends
+ * records (pw_head), and only the drainer removes them (pw_tail)
+ */
+typedef struct PW_trace_ring
+{
+    char *             pw_records;
+    unsigned long long pw_begin;
+    unsigned long long pw_head;
+    unsigned long long pw_dropped;
+    char               pw_pad[PW_CACHE_LINE];
+    unsigned long long pw_tail;
+} PW_trace_ring_t;
+#    endif
+
+#    if defined(PW_SAMPLING)
+#        if !defined(PW_HOTSPOTS_FILENAME)
+#            define PW_HOTSPOTS_FILENAME "/tmp/__tmp_papi_wrapper.hotspots"
+#        endif
+/* Overflow addresses kept by each thread */
+#        if !defined(PW_SAMPLES)
+#            define PW_SAMPLES 65536
+#        endif
+
+/**
+ * @brief Address interrupted by an overflow of an event, and the threshold of
+ * the event then
+ */
+typedef struct PW_sample
+{
+    void *pw_addr;
+    int   pw_evid;
+    int   pw_threshold;
+} PW_sample_t;
+#    endif
+
 /**
  * @brief Struct to handle each PAPI thread info
  *
  * We have to store the EventSet, also the values obtained by all the different
  * counters. The same way, we also enable some attributes when sampling is
- * enabled.
+ * enabled. Entries are aligned to cache lines, so threads do not share them,
+ * and point to storage allocated and touched first by their own thread.
  */
 typedef struct PW_thread_info
 {
-    int                   *pw_eventset;
-    int                   *pw_eventlist;
-    int                    pw_domain;
-    long long             *pw_values;
-    PW_thread_subregion_t *pw_subregions;
+    int                    *pw_eventset;
+    int                     pw_domain;
+    int                     pw_group;
+    long long              *pw_values;
+    PW_thread_subregion_t  *pw_subregions;
+    PW_thread_subregion_t **pw_named;
+    int                     pw_named_cap;
+    PW_subregion_tree_t     pw_tree;
+#    if defined(PW_TRACE)
+    PW_trace_ring_t pw_trace;
+#    endif
 #    if defined(PW_SAMPLING)
-    int        pw_overflow_enabled;
-    long long *pw_overflows;
+    int                pw_overflow_enabled;
+    long long         *pw_overflows;
+    int               *pw_thresholds;
+    unsigned long long pw_sampling_begin;
+    PW_sample_t       *pw_samples;
+    int                pw_num_samples;
+    long long          pw_samples_dropped;
+#    endif
+#    if defined(PW_RDPMC) || defined(PW_BACKEND_PERF) \
+        || (PW_EXEC_MODE == PW_MPX_EXC)
+    void *pw_perf;
+#    endif
+#    if (PW_EXEC_MODE == PW_MPX_EXC)
+    double *pw_coverage;
 #    endif
-} PW_thread_info_t;
+#    if defined(PW_REPETITIONS)
+    long long *pw_reps;
+    int        pw_run;
+#    endif
+#    if defined(PW_CALIBRATE)
+    long long         *pw_overhead;
+    unsigned long long pw_overhead_ns[2];
+#    endif
+    char *pw_block;
+} __attribute__((aligned(PW_CACHE_LINE))) PW_thread_info_t;
 
 /* Useful macros */
 #    define PW_VALUES(__pw_nthread, __pw_evid) \
         (PW_thread[__pw_nthread].pw_values[__pw_evid])
 #    define PW_EVTLST(__pw_nthread, __pw_evid) pw_eventlist[__pw_evid]
-//(PW_thread[__pw_nthread].pw_eventlist[__pw_evid])
 #    define PW_EVTSET(__pw_nthread, __pw_evid) \
         (PW_thread[__pw_nthread].pw_eventset[__pw_evid])
-#    define PW_SUBREG_VAL(__pw_nthread, __pw_evid, n) \
-        (PW_thread[__pw_nthread].pw_subregions[n].pw_values[__pw_evid])
-#    define PW_SUBREG_DELTA(__pw_nthread, __pw_evid, n) \
-        (PW_thread[__pw_nthread].pw_subregions[n].pw_delta)
+/* Events of group __pw_grp are pw_group_events[pw_group_offset[__pw_grp]..
+ * pw_group_offset[__pw_grp + 1]), in the order they are added to the
+ * EventSet (i.e. the order PAPI_read/PAPI_stop return them) */
+#    define PW_GRP_SIZE(__pw_grp) \
+        (pw_group_offset[(__pw_grp) + 1] - pw_group_offset[(__pw_grp)])
+#    define PW_GRP_EVT(__pw_grp, __pw_pos) \
+        (pw_group_events[pw_group_offset[(__pw_grp)] + (__pw_pos)])
+#    if defined(PW_REPETITIONS)
+/* Values of an event in each repetition, after the warm-up executions */
+#        define PW_REPS(__pw_reps, __pw_evid) \
+            (&(__pw_reps)[(__pw_evid)*PW_REPETITIONS])
+#    endif
+#    if defined(PW_CALIBRATE)
+/* Median overhead of an empty region of interest, and of an empty subregion
+ * call, on each event */
+#        define PW_OVERHEAD(__pw_nthread, __pw_evid) \
+            (PW_thread[__pw_nthread].pw_overhead[__pw_evid])
+#        define PW_OVERHEAD_SUB(__pw_nthread, __pw_evid) \
+            (PW_thread[__pw_nthread].pw_overhead[pw_num_ctrs + (__pw_evid)])
+#    endif
+#    if (PW_EXEC_MODE == PW_MPX_EXC)
+/* Fraction of the region of interest during which an event was counted (NAN
+ * if unknown, i.e. the EventSet is multiplexed by PAPI) */
+#        define PW_COVERAGE(__pw_nthread, __pw_evid) \
+            (PW_thread[__pw_nthread].pw_coverage[__pw_evid])
+#    endif
 #    if defined(PW_SAMPLING)
 #        define PW_OVRFLW_ON(__pw_nthread) \
             (PW_thread[__pw_nthread].pw_overflow_enabled = 1)
@@ -140,6 +380,10 @@ typedef struct PW_thread_info
             (PW_thread[__pw_nthread].pw_overflows[__pw_evid])
 #        define PW_OVRFLW_RST(__pw_nthread, __pw_evid) \
             (PW_thread[__pw_nthread].pw_overflows[__pw_evid] = 0)
+/* Threshold of an event in the thread: the one of PAPI_FILE_SAMPLING, unless
+ * adapted to -DPW_SAMPLING_RATE */
+#        define PW_THRESHOLD(__pw_nthread, __pw_evid) \
+            (PW_thread[__pw_nthread].pw_thresholds[__pw_evid])
 /* This is the recommended type of overflowing with PAPI. See PAPI_overflow
  * manual for more details */
 #        define PW_OVRFLW_TYPE PAPI_OVERFLOW_FORCE_SW
@@ -151,7 +395,7 @@ typedef struct PW_thread_info
 #    endif
 
 #    if defined(PW_SAMPLING)
-#        if !defined(PAPI_FILE_SAMPLING
+#        if !defined(PAPI_FILE_SAMPLING)
 #            define PAPI_FILE_SAMPLING "papi_sampling.list"
 #        endif
 #    endif
@@ -160,12 +404,22 @@ typedef struct PW_thread_info
 extern int               __PW_NSUBREGIONS;
 extern PW_thread_info_t *PW_thread;
 extern int              *pw_eventlist;
+extern int               pw_num_groups;
+extern int              *pw_group_events;
+extern int              *pw_group_offset;
 extern int               pw_counters_threadid;
+extern int               pw_cache_mode;
 /**
  * @brief Set thread for measuring
  */
 #    define pw_set_thread_report(__pw_th_x) pw_counters_threadid = __pw_th_x;
 
+/**
+ * @brief Set state of caches before each execution: PW_CACHE_COLD,
+ * PW_CACHE_WARM or PW_CACHE_NONE
+ */
+#    define pw_set_cache_mode(__pw_mode) pw_cache_mode = __pw_mode;
+
 /**
  * @brief Init PAPI library and prepare instruments: flush cache of all
  * threads, basically
@@ -176,13 +430,18 @@ extern int               pw_counters_threadid;
 
 /**
  * @brief Init PAPI library and prepare instruments: flush cache of all
- * threads
+ * threads. The region of interest is executed once per event group, i.e.
+ * __pw_evid iterates over groups: one event each in PW_SNG_EXC mode, as many
+ * as hardware counters available in PW_ALL_EXC mode, and all of them
+ * (multiplexed) in PW_MPX_EXC mode. With -DPW_REPETITIONS, PW_RUNS times
  */
-#    define pw_start_instruments                                       \
-        int __pw_evid;                                                 \
-        for (__pw_evid = 0; pw_eventlist[__pw_evid] != 0; __pw_evid++) \
-        {                                                              \
-            pw_prepare_instruments();                                  \
+#    define pw_start_instruments                                           \
+        int __pw_evid;                                                     \
+        int __pw_run;                                                      \
+        for (__pw_run = 0; __pw_run < pw_num_groups * PW_RUNS; __pw_run++) \
+        {                                                                  \
+            __pw_evid = __pw_run / PW_RUNS;                                \
+            pw_prepare_instruments();                                      \
             if (pw_start_counter(__pw_evid)) continue;
 
 /**
@@ -202,13 +461,17 @@ extern int               pw_counters_threadid;
         pw_start_instruments;
 
 /**
- * @brief Init for a concrete thread
+ * @brief Start counters from within an existing parallel region: every thread
+ * of the team prepares its caches and starts its own counters in place, so
+ * no parallel region is forked around the region of interest
  */
-#    define pw_start_instruments_loop(th)                              \
-        int __pw_evid;                                                 \
-        for (__pw_evid = 0; pw_eventlist[__pw_evid] != 0; __pw_evid++) \
-        {                                                              \
-            pw_prepare_instruments();                                  \
+#    define pw_start_instruments_loop(th)                                  \
+        int __pw_evid;                                                     \
+        int __pw_run;                                                      \
+        for (__pw_run = 0; __pw_run < pw_num_groups * PW_RUNS; __pw_run++) \
+        {                                                                  \
+            __pw_evid = __pw_run / PW_RUNS;                                \
+            pw_prepare_instruments_thread();                               \
             pw_start_counter_thread(__pw_evid, th);
 
 /**
@@ -219,12 +482,62 @@ extern int               pw_counters_threadid;
         }
 
 /**
- * @brief Stop
+ * @brief Stop counters from within the parallel region that started them
  */
 #    define pw_stop_instruments_loop(__pw_th)       \
         pw_stop_counter_thread(__pw_evid, __pw_th); \
         }
 
+#    if defined(PW_REPETITIONS)
+/**
+ * @brief Start measuring variants of the region of interest (e.g. different
+ * implementations of a kernel) together: for each group of events, every
+ * round executes each variant once, in a random order, so that drift among
+ * executions affects all of them alike. pw_variant is the variant to execute
+ */
+#        define pw_start_variants(__pw_nvariants)                        \
+            int __pw_evid;                                               \
+            int __pw_variant;                                            \
+            int __pw_run;                                                \
+            pw_variants_begin(__pw_nvariants);                           \
+            for (__pw_run = 0;                                           \
+                 __pw_run < pw_num_groups * PW_RUNS * (__pw_nvariants);  \
+                 __pw_run++)                                             \
+            {                                                            \
+                __pw_evid    = __pw_run / (PW_RUNS * (__pw_nvariants));  \
+                __pw_variant = pw_variant_get(__pw_run);                 \
+                pw_prepare_instruments();                                \
+                if (pw_start_counter(__pw_evid)) continue;
+
+/**
+ * @brief Init PAPI library, prepare instruments and start measuring variants
+ */
+#        define pw_init_start_variants(__pw_nvariants) \
+            pw_init_instruments;                       \
+            pw_start_variants(__pw_nvariants);
+
+/**
+ * @brief Variant to execute, within pw_start_variants and pw_stop_variants
+ */
+#        define pw_variant __pw_variant
+
+/**
+ * @brief Stop measuring the variant executed
+ */
+#        define pw_stop_variants         \
+            pw_stop_counter(__pw_evid);  \
+            pw_variant_record(__pw_run); \
+            }                            \
+            pw_variants_end();
+
+/**
+ * @brief Print the variants and their differences, and close
+ */
+#        define pw_print_variants \
+            pw_print_var();       \
+            pw_close();
+#    endif
+
 /**
  * @brief Begin the subregion
  */
@@ -237,6 +550,34 @@ extern int               pw_counters_threadid;
 #    define pw_end_subregion(__pw_subreg_n) \
         pw_end_counter_subregion(__pw_evid, __pw_subreg_n);
 
+/**
+ * @brief Handle of a named subregion: registered the first time the call site
+ * is reached, and cached in a static variable afterwards
+ */
+#    define PW_SUBREG_HANDLE(__pw_name)                                     \
+        ({                                                                  \
+            static int __pw_subreg_h = -1;                                  \
+            int __pw_h = __atomic_load_n(&__pw_subreg_h, __ATOMIC_ACQUIRE); \
+            if (__pw_h < 0)                                                 \
+            {                                                               \
+                __pw_h = pw_subregion_register(__pw_name);                  \
+                __atomic_store_n(&__pw_subreg_h, __pw_h, __ATOMIC_RELEASE); \
+            }                                                               \
+            __pw_h;                                                         \
+        })
+
+/**
+ * @brief Begin a named subregion; no need to set the number of subregions
+ */
+#    define pw_begin_subregion_named(__pw_name) \
+        pw_begin_counter_subregion(__pw_evid, PW_SUBREG_HANDLE(__pw_name));
+
+/**
+ * @brief End a named subregion
+ */
+#    define pw_end_subregion_named(__pw_name) \
+        pw_end_counter_subregion(__pw_evid, PW_SUBREG_HANDLE(__pw_name));
+
 /**
  * @brief Print and close
  */
@@ -255,24 +596,46 @@ extern int               pw_counters_threadid;
 extern void
 pw_prepare_instruments();
 extern void
+pw_prepare_instruments_thread();
+extern void
+pw_flush_range(void *ptr, size_t bytes);
+extern void
 pw_init();
 extern void
 pw_close();
 extern int
-pw_start_counter(int __pw_evid);
+pw_start_counter(int __pw_grp);
 extern void
-pw_stop_counter(int __pw_evid);
+pw_stop_counter(int __pw_grp);
 extern int
-pw_start_counter_thread(int __pw_evid, int __pw_th);
+pw_start_counter_thread(int __pw_grp, int __pw_th);
 extern void
-pw_stop_counter_thread(int __pw_evid, int __pw_th);
+pw_stop_counter_thread(int __pw_grp, int __pw_th);
+extern int
+pw_subregion_register(const char *name);
+#    if defined(PW_TRACE)
+extern int
+pw_trace_export(const char *trace, const char *json);
+#    endif
 extern void
-pw_begin_counter_subregion(int __pw_evid, int __pw_subreg_n);
+pw_begin_counter_subregion(int __pw_grp, int __pw_subreg_n);
 extern void
-pw_end_counter_subregion(int __pw_evid, int __pw_subreg_n);
+pw_end_counter_subregion(int __pw_grp, int __pw_subreg_n);
 extern void
 pw_print();
 extern void
 pw_print_sub();
+#    if defined(PW_REPETITIONS)
+extern void
+pw_variants_begin(int __pw_nvariants);
+extern int
+pw_variant_get(int __pw_run);
+extern void
+pw_variant_record(int __pw_run);
+extern void
+pw_variants_end();
+extern void
+pw_print_var();
+#    endif
 
 #endif /* !PAPI_WRAPPER_H */
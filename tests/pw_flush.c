@@ -0,0 +1,45 @@
+#include <papi_wrapper.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test_lib.h"
+
+int
+main()
+{
+    int     N = 1 << 20;
+    double *x = (double *)malloc(sizeof(double) * N);
+    double *y = (double *)malloc(sizeof(double) * N);
+    int     modes[] = {PW_CACHE_COLD, PW_CACHE_WARM, PW_CACHE_NONE};
+
+    for (int i = 0; i < N; ++i)
+    {
+        x[i] = i;
+    }
+    /* only the arrays of the kernel are flushed or touched */
+    pw_flush_range(x, sizeof(double) * N);
+    pw_flush_range(y, sizeof(double) * N);
+    pw_init_instruments;
+    for (int m = 0; m < 3; ++m)
+    {
+        pw_set_cache_mode(modes[m]);
+        pw_start_instruments;
+#pragma omp parallel for
+        for (int i = 0; i < N; ++i)
+        {
+            y[i] = x[i] * 42.3;
+        }
+        pw_stop_instruments;
+        pw_print();
+    }
+    pw_close();
+
+    /* avoid code elimination */
+    for (int i = 0; i < N; i += N / 10)
+    {
+        printf("y[%d]\t%f\n", i, y[i]);
+    }
+    free(x);
+    free(y);
+    return pw_test_pass(__FILE__);
+}
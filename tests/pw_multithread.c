@@ -15,6 +15,7 @@ main()
 #pragma omp parallel
     {
         pw_start_instruments_loop(omp_get_thread_num());
+#pragma omp for
         for (int i = 0; i < N; ++i)
         {
 
@@ -0,0 +1,44 @@
+#include <omp.h>
+#include <papi_wrapper.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test_lib.h"
+
+int
+main()
+{
+    int N = 64;
+    int x[N];
+    pw_init_start_instruments;
+
+#if defined(_OPENMP)
+#    pragma omp parallel for
+#endif
+    for (int i = 0; i < N; ++i)
+    {
+        pw_begin_subregion_named("scale");
+        x[i] = i * 42.3;
+        pw_end_subregion_named("scale");
+
+        /* Registered by the first thread reaching it */
+        if (i % 2 == 0)
+        {
+            pw_begin_subregion_named("even");
+            x[i] += i;
+            pw_end_subregion_named("even");
+        }
+    }
+    pw_stop_instruments;
+    pw_print_subregions;
+
+    /* avoid code elimination */
+    for (int i = 0; i < N; ++i)
+    {
+        if (i % 100 == 0)
+        {
+            printf("x[%d]\t%d\n", i, x[i]);
+        }
+    }
+    return pw_test_pass(__FILE__);
+}
@@ -0,0 +1,45 @@
+#include <omp.h>
+#include <papi_wrapper.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test_lib.h"
+
+int
+main()
+{
+    int N = 64;
+    int T = 4;
+    int x[N];
+    pw_init_start_instruments;
+
+    for (int t = 0; t < T; ++t)
+    {
+        pw_begin_subregion_named("timestep");
+#if defined(_OPENMP)
+#    pragma omp parallel for
+#endif
+        for (int i = 0; i < N; ++i)
+        {
+            pw_begin_subregion_named("assemble");
+            x[i] = i * 42.3;
+            pw_begin_subregion_named("kernel");
+            x[i] += t;
+            pw_end_subregion_named("kernel");
+            pw_end_subregion_named("assemble");
+        }
+        pw_end_subregion_named("timestep");
+    }
+    pw_stop_instruments;
+    pw_print_subregions;
+
+    /* avoid code elimination */
+    for (int i = 0; i < N; ++i)
+    {
+        if (i % 100 == 0)
+        {
+            printf("x[%d]\t%d\n", i, x[i]);
+        }
+    }
+    return pw_test_pass(__FILE__);
+}
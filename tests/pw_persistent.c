@@ -0,0 +1,36 @@
+#include <papi_wrapper.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test_lib.h"
+
+int
+main()
+{
+    int N = 1000;
+    int x[N];
+    pw_init_instruments;
+    /* parameter sweep: same EventSets reused for every execution */
+    for (int p = 1; p <= 4; ++p)
+    {
+        pw_start_instruments;
+#pragma omp parallel for
+        for (int i = 0; i < N; ++i)
+        {
+            x[i] = i * p * 42.3;
+        }
+        pw_stop_instruments;
+        pw_print();
+    }
+    pw_close();
+
+    /* avoid code elimination */
+    for (int i = 0; i < N; ++i)
+    {
+        if (i % 100 == 0)
+        {
+            printf("x[%d]\t%d\n", i, x[i]);
+        }
+    }
+    return pw_test_pass(__FILE__);
+}
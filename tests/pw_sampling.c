@@ -0,0 +1,45 @@
+#include <papi_wrapper.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "test_lib.h"
+
+int
+main()
+{
+    int         N = 1 << 20;
+    double *    x = (double *)malloc(sizeof(double) * N);
+    struct stat st;
+    pw_init_start_instruments;
+    /* long enough to overflow the thresholds of PAPI_FILE_SAMPLING */
+    for (int k = 0; k < 16; ++k)
+    {
+#if defined(_OPENMP)
+#    pragma omp parallel for
+#endif
+        for (int i = 0; i < N; ++i)
+        {
+            x[i] = i * 42.3 + k;
+        }
+    }
+    pw_stop_instruments;
+    pw_print_instruments;
+
+    /* avoid code elimination */
+    for (int i = 0; i < N; ++i)
+    {
+        if (i % (N / 8) == 0)
+        {
+            printf("x[%d]\t%f\n", i, x[i]);
+        }
+    }
+    free(x);
+
+    /* hotspots are written by pw_close */
+    if ((stat(PW_HOTSPOTS_FILENAME, &st) != 0) || (st.st_size == 0))
+    {
+        return pw_test_fail(__FILE__);
+    }
+    return pw_test_pass(__FILE__);
+}
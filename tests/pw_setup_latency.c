@@ -0,0 +1,28 @@
+#include <omp.h>
+#include <papi_wrapper.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test_lib.h"
+
+/* Startup latency: time spent in pw_init setting up all EventSets (built in
+ * pw_init with -DPW_PERSISTENT) depending on the number of threads */
+int
+main()
+{
+    int max_threads = omp_get_max_threads();
+
+    printf("threads%ssetup_us\n", PW_CSV_SEPARATOR);
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2)
+    {
+        omp_set_num_threads(nthreads);
+        double t0 = omp_get_wtime();
+        pw_init();
+        double t1 = omp_get_wtime();
+        pw_close();
+        printf("%d%s%.1f\n", nthreads, PW_CSV_SEPARATOR, (t1 - t0) * 1e6);
+        if ((nthreads < max_threads) && (nthreads * 2 > max_threads))
+            nthreads = max_threads / 2;
+    }
+    return pw_test_pass(__FILE__);
+}
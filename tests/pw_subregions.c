@@ -12,7 +12,7 @@ main()
     int x[N];
     pw_init_start_instruments_sub(2);
 
-#if defined(PW_MULTITHREAD)
+#if defined(_OPENMP)
 #    pragma omp parallel for
 #endif
     for (int i = 0; i < N; ++i)
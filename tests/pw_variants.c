@@ -0,0 +1,42 @@
+#include <papi_wrapper.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test_lib.h"
+
+int
+main()
+{
+    int N = 1000;
+    int x[N];
+    pw_init_start_variants(2);
+    if (pw_variant == 0)
+    {
+#pragma omp parallel for
+        for (int i = 0; i < N; ++i)
+        {
+            x[i] = i * 42.3;
+        }
+    } else
+    {
+        /* Same result, twice the work */
+#pragma omp parallel for
+        for (int i = 0; i < N; ++i)
+        {
+            x[i] = i * 21.15;
+            x[i] = i * 42.3;
+        }
+    }
+    pw_stop_variants;
+    pw_print_variants;
+
+    /* avoid code elimination */
+    for (int i = 0; i < N; ++i)
+    {
+        if (i % 100 == 0)
+        {
+            printf("x[%d]\t%d\n", i, x[i]);
+        }
+    }
+    return pw_test_pass(__FILE__);
+}